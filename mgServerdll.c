@@ -9,11 +9,85 @@ static int g_log_enabled = 1;
 static LogTarget g_log_target = LOG_TARGET_CONSOLE;
 static FILE* g_log_file = NULL;
 
+// 按来源 IP 限流：开放寻址哈希表，每个 IP 一项，令牌以千分之一为单位
+struct IpEntry {
+    uint8_t ip[16];
+    uint32_t last;         // 上次补充令牌的时间(ms，取 mg_millis 低 32 位)
+    uint32_t conns;        // 当前连接数
+    uint32_t conn_tokens;  // 新建连接令牌
+    uint32_t req_tokens;   // 请求令牌
+    uint8_t used, is_ip6;
+};
+
+struct IpTable {
+    struct IpEntry* slots;  // cap 为 2 的幂，NULL=未启用限流
+    size_t cap, count;
+};
+
+// 动态响应微缓存：HttpCallback 内调用 Server_HttpCache 标记的响应序列化后保存，
+// 有效期内相同的请求直接从事件循环回复。每个 URI 有一条 vary 记录，按其规则
+// 从查询串和请求头拼出各变体的键
+#define CACHE_VARY_MAX 256
+
+struct CacheEntry {
+    struct CacheEntry* next;      // 同一哈希桶
+    struct SharedPayload* resp;   // 完整响应（状态行、头和正文），按引用发送；NULL=vary 记录
+    uint64_t expires;             // 此前为新鲜
+    uint64_t stale_until;         // 此前过期仍可回复，同时在后台刷新
+    uint32_t hash;
+    int refreshing;               // 已安排后台刷新
+    size_t key_len, size;         // size 为计入 cache_max_bytes 的字节数
+    char key[];                   // 以 0 结尾，vary 记录随后是 vary 规则
+};
+
+struct Cache {
+    struct CacheEntry** slots;  // cap 为 2 的幂，NULL=尚未缓存过
+    size_t cap, count, bytes;
+    struct mg_timer refresh;    // 后台刷新过期条目，挂在 mgr.timers 上
+    int armed;
+    // 回调期间由 Server_HttpCache、Server_HttpDefer 设置
+    unsigned long long conn_id; // 正在回调的连接，0=后台刷新
+    int in_cb, marked, deferred, ttl_ms, stale_ms;
+    char vary[CACHE_VARY_MAX];
+};
+
+// 合并相同的请求：HttpCallback 调用 Server_HttpDefer 推迟回复后，方法、URI 和
+// coalesce_vary 相同的请求不再调用回调，等到 Server_HttpReply 时收到同一份响应
+struct Waiter {
+    struct mg_connection* c;
+    uint64_t deadline;  // 过时回复 504
+};
+
+struct Flight {
+    struct Flight* next;
+    unsigned long long leader;  // 推迟回复的连接
+    struct mg_connection* lc;   // 同上，已断开时为 NULL，回复仍送达等待的连接
+    struct Waiter* waiters;
+    size_t n, cap;
+    int ttl_ms, stale_ms;       // 回调标记了可缓存时，回复后存入缓存
+    size_t key_len, ckey_len;   // ckey_len 为 0 表示不缓存
+    char key[];                 // 合并键，随后是缓存键和 vary 规则
+};
+
 struct Server {
     struct mg_mgr mgr;
     ServerConfig config;
     HttpCallback http_cb;
     WsCallback ws_cb;
+    HttpBodyCallback body_cb;
+    char* body_prefix;  // 以此开头的 URI 请求体分段交付，NULL=仅按 http_stream_min
+    char* upload_prefix;  // 以此开头的 URI 请求体直接写入 upload_dir，NULL=未设置
+    char* upload_dir;
+    unsigned long long upload_max;
+    UploadCallback upload_cb;
+    HttpWritableCallback writable_cb;
+    SendQueueCallback sendq_cb;
+    ServerStats stats;
+    struct IpTable ips;
+    struct Cache cache;
+    struct Flight* flights;     // 推迟回复、尚未完成的请求，通常只有几个
+    struct mg_timer flight_timer;  // 等待超时，挂在 mgr.timers 上
+    int flight_armed;
     void* user_data;
     struct mg_connection* listener;
 };
@@ -43,6 +117,969 @@ static void log_with_time(LogLevel level, const char* file, int line, const char
     fflush(out);
 }
 
+// 上传直接落盘：请求体（或 multipart 中的文件）边收边写入文件，写入经 stdio 大缓冲合并
+#define UPLOAD_WRITE_BUF (1024 * 1024)
+
+struct Upload {
+    FILE* fp;
+    char* wbuf;                  // fp 的写缓冲，UPLOAD_WRITE_BUF 字节
+    char path[MG_PATH_MAX];
+    unsigned long long size;     // 当前文件已写入字节
+    unsigned long long total;    // 整个请求体已接收字节
+    long offset;                 // 续传：写入前文件已有的字节数
+    char boundary[80];           // multipart 分隔符 "\r\n--xxx"，空表示整个请求体即文件内容
+    size_t blen;
+    int in_part;                 // multipart：正在接收文件内容
+    int done;                    // multipart：已遇到结束分隔符
+    struct mg_iobuf pending;     // multipart：尚未确认不含分隔符的数据
+};
+
+// 广播消息的共享副本：只拷贝一次，各连接按引用发送，最后一个引用释放时 free
+struct SharedPayload {
+    int refs;
+    size_t len;
+    const char* key;  // 合并键，见 Server_WsBroadcastKeyed，NULL=不合并
+    char data[];
+};
+
+static struct SharedPayload* shared_payload_new(const void* data, size_t len, const char* key) {
+    size_t klen = key ? strlen(key) + 1 : 0;
+    struct SharedPayload* p = (struct SharedPayload*)malloc(sizeof(*p) + len + klen);
+    if (p != NULL) {
+        memcpy(p->data, data, len);
+        p->len = len;
+        p->key = key ? (const char*)memcpy(p->data + len, key, klen) : NULL;
+        p->refs = 1;  // 循环期间自己持有一个引用
+    }
+    return p;
+}
+
+static void shared_payload_release(void* arg) {
+    struct SharedPayload* p = (struct SharedPayload*)arg;
+    if (p != NULL && --p->refs == 0) free(p);
+}
+
+// 慢消费者：广播时连接待发送数据超过 slow_queue_bytes，后续广播按 slow_policy 暂存、丢弃或断开
+#define SLOW_QUEUE_BYTES (1024 * 1024)
+
+struct HeldFrame {
+    struct SharedPayload* p;
+    int op;
+};
+
+struct SlowQueue {
+    struct HeldFrame* items;  // 环形队列：尚未放入发送缓冲的广播消息
+    size_t head, n, cap;
+    size_t bytes;
+    uint64_t since;           // 待发送数据开始超限的时间(ms)，0=未超限
+};
+
+// WebSocket 连接的附加状态，按需分配：开启保活时升级即分配，否则首次成为慢消费者时分配
+struct WsState {
+    struct SlowQueue slow;
+    struct mg_timer ping;        // 保活定时器，挂在 mgr.timers 时间轮上
+    struct mg_connection* c;
+    uint64_t last_seen;          // 最近一次收到消息或 pong 的时间(ms)
+};
+
+// 每连接的 DLL 状态，存放在 c->data 中。c->data 末尾的 size_t 由 mongoose
+// 发送静态文件时记录剩余长度，不可占用
+struct ConnData {
+    struct Upload* upload;  // 上传落盘状态，见 Server_SetUploadRoute
+    struct WsState* ws;     // WebSocket 附加状态，见 ws_state
+    unsigned int high : 31;      // 发送队列高水位，0=不监视
+    unsigned int streaming : 1;  // 正在以 chunked 方式流式发送响应，见 Server_HttpBeginStream
+    unsigned int low : 30;       // 发送队列低水位
+    unsigned int above : 1;      // 已越过高水位，尚未回落到低水位
+};
+
+#define SENDQ_HIGH_MAX 0x7fffffffU
+#define SENDQ_LOW_MAX 0x3fffffffU
+
+typedef char conn_data_fits[sizeof(struct ConnData) <= MG_DATA_SIZE - sizeof(size_t) ? 1 : -1];
+
+#define CONN_DATA(c) ((struct ConnData*)(c)->data)
+#define UPLOAD_OF(c) (CONN_DATA(c)->upload)
+#define WS_OF(c) (CONN_DATA(c)->ws)
+#define SLOW_OF(c) (WS_OF(c) ? &WS_OF(c)->slow : NULL)
+
+// 流式响应：待发送数据低于窗口一半时调用可写回调，告知还可写入多少字节
+#define STREAM_WINDOW (256 * 1024)
+
+static void stream_writable(struct Server* server, struct mg_connection* c) {
+    size_t queued;
+    if (!server->writable_cb || c->is_closing || c->is_draining) return;
+    queued = mg_send_queued(c);
+    if (queued < STREAM_WINDOW / 2) server->writable_cb((ServerHandle*)server, c->id, STREAM_WINDOW - queued);
+}
+
+// 发送队列水位：入队后越过高水位、或 write 后回落到低水位时各通知一次
+static void sendq_watch(struct Server* server, struct mg_connection* c) {
+    struct ConnData* cd = CONN_DATA(c);
+    size_t queued;
+    if (cd->high == 0 || !server->sendq_cb) return;
+    queued = mg_send_queued(c);
+    if (!cd->above && queued >= cd->high) {
+        cd->above = 1;
+        server->sendq_cb((ServerHandle*)server, c->id, queued, 1);
+    } else if (cd->above && queued <= cd->low) {
+        cd->above = 0;
+        server->sendq_cb((ServerHandle*)server, c->id, queued, 0);
+    }
+}
+
+static void sendq_limits(struct ConnData* cd, unsigned int high, unsigned int low) {
+    if (high > SENDQ_HIGH_MAX) high = SENDQ_HIGH_MAX;
+    low = low > 0 && low < high ? low : high / 2;
+    cd->high = high;
+    cd->low = low > SENDQ_LOW_MAX ? SENDQ_LOW_MAX : low;
+    cd->above = 0;
+}
+
+static struct WsState* ws_state(struct mg_connection* c) {
+    if (WS_OF(c) == NULL && (WS_OF(c) = (struct WsState*)calloc(1, sizeof(struct WsState))) != NULL) {
+        WS_OF(c)->c = c;
+        WS_OF(c)->last_seen = mg_millis();
+    }
+    return WS_OF(c);
+}
+
+static size_t slow_limit(const struct Server* server) {
+    return server->config.slow_queue_bytes > 0 ? (size_t)server->config.slow_queue_bytes : SLOW_QUEUE_BYTES;
+}
+
+// 广播前检查连接：0=直接发送，1=暂存，-1=已断开
+static int slow_check(struct Server* server, struct mg_connection* c) {
+    struct SlowQueue* q = SLOW_OF(c);
+    uint64_t now;
+    if (q != NULL && q->n > 0) return 1;  // 已有暂存时保持顺序
+    if (mg_send_queued(c) < slow_limit(server)) {
+        if (q != NULL) q->since = 0;
+        return 0;
+    }
+    if (q == NULL) {
+        if (ws_state(c) == NULL) return 0;
+        q = SLOW_OF(c);
+    }
+    if (server->config.slow_policy != SLOW_POLICY_DISCONNECT) return 1;
+    now = mg_millis();
+    if (q->since == 0) q->since = now;
+    if (now - q->since < (uint64_t)server->config.slow_timeout_ms) return 0;
+    LOG(LOG_LEVEL_WARN,"Disconnecting slow consumer %llu: %lu bytes queued", (unsigned long long)c->id,
+        (unsigned long)mg_send_queued(c));
+    server->stats.ws_slow_disconnects++;
+    c->is_closing = 1;
+    mg_conn_activate(c);  // 由广播触发，不在该连接的事件中
+    return -1;
+}
+
+// 暂存一条广播（取得 p 的一个引用）：同键的旧消息被替换，超过上限时丢弃最早的
+static void slow_hold(struct Server* server, struct mg_connection* c, struct SharedPayload* p, int op) {
+    struct SlowQueue* q = SLOW_OF(c);
+    struct HeldFrame* f;
+    size_t i, limit = slow_limit(server);
+    if (server->config.slow_policy == SLOW_POLICY_CONFLATE && p->key != NULL) {
+        for (i = 0; i < q->n; i++) {
+            f = &q->items[(q->head + i) % q->cap];
+            if (f->p->key != NULL && strcmp(f->p->key, p->key) == 0) {
+                q->bytes += p->len - f->p->len;
+                shared_payload_release(f->p);
+                f->p = p, f->op = op;
+                server->stats.ws_conflated++;
+                return;
+            }
+        }
+    }
+    if (q->n == q->cap) {
+        size_t cap = q->cap ? q->cap * 2 : 16;
+        f = (struct HeldFrame*)malloc(cap * sizeof(*f));
+        if (f == NULL) {
+            server->stats.ws_dropped_frames++;
+            server->stats.ws_dropped_bytes += p->len;
+            shared_payload_release(p);
+            return;
+        }
+        for (i = 0; i < q->n; i++) f[i] = q->items[(q->head + i) % q->cap];
+        free(q->items);
+        q->items = f, q->cap = cap, q->head = 0;
+    }
+    q->items[(q->head + q->n++) % q->cap] = (struct HeldFrame){p, op};
+    q->bytes += p->len;
+    while (q->bytes > limit && q->n > 1) {
+        f = &q->items[q->head];
+        q->bytes -= f->p->len;
+        server->stats.ws_dropped_frames++;
+        server->stats.ws_dropped_bytes += f->p->len;
+        shared_payload_release(f->p);
+        q->head = (q->head + 1) % q->cap, q->n--;
+    }
+}
+
+// 发送缓冲有空余时把暂存的广播依次放入
+static void slow_drain(struct Server* server, struct mg_connection* c) {
+    struct SlowQueue* q = SLOW_OF(c);
+    size_t limit = slow_limit(server);
+    while (q != NULL && q->n > 0 && !c->is_closing && mg_send_queued(c) < limit) {
+        struct HeldFrame f = q->items[q->head];
+        q->head = (q->head + 1) % q->cap, q->n--;
+        q->bytes -= f.p->len;
+        mg_ws_send_ref(c, f.p->data, f.p->len, f.op, shared_payload_release, f.p);
+    }
+}
+
+// 保活：定时器按 ws_ping_interval_ms 周期触发，期间没收到任何消息就发 ping，
+// 超过 ws_ping_timeout_ms 仍无消息或 pong 则断开
+static void ws_keepalive(void* arg) {
+    struct WsState* ws = (struct WsState*)arg;
+    struct mg_connection* c = ws->c;
+    struct Server* server = (struct Server*)c->mgr->userdata;
+    uint64_t idle = mg_millis() - ws->last_seen;
+    uint64_t timeout = server->config.ws_ping_timeout_ms > 0 ? (uint64_t)server->config.ws_ping_timeout_ms
+                                                             : 2 * (uint64_t)server->config.ws_ping_interval_ms;
+    if (c->is_closing || c->is_draining) return;
+    if (idle >= timeout) {
+        LOG(LOG_LEVEL_DEBUG,"Reaping idle WebSocket %llu after %llu ms", (unsigned long long)c->id, (unsigned long long)idle);
+        server->stats.ws_reaped++;
+        c->is_closing = 1;
+        mg_conn_activate(c);  // 由定时器触发，连接本身可能没有事件
+    } else if (idle + 1 >= (uint64_t)server->config.ws_ping_interval_ms) {
+        mg_ws_send(c, "", 0, WEBSOCKET_OP_PING);
+    }
+}
+
+static void ws_free(struct mg_connection* c) {
+    struct WsState* ws = WS_OF(c);
+    struct SlowQueue* q;
+    if (ws == NULL) return;
+    q = &ws->slow;
+    for (; q->n > 0; q->n--, q->head = (q->head + 1) % q->cap) shared_payload_release(q->items[q->head].p);
+    free(q->items);
+    mg_timer_del(c->mgr, &ws->ping);  // mg_mgr_free 已摘除时为空操作
+    free(ws);
+    WS_OF(c) = NULL;
+}
+
+static void upload_finish(struct Server* server, struct mg_connection* c, struct Upload* u, int status) {
+    if (u->fp == NULL) return;
+    if (fclose(u->fp) != 0 && status == 0) status = -1;
+    u->fp = NULL;
+    free(u->wbuf);  // glibc 的 setvbuf 忽略 size，缓冲须自行提供
+    u->wbuf = NULL;
+    if (status != 0 && u->offset == 0) remove(u->path);  // 续传失败时保留已有部分
+    LOG(LOG_LEVEL_DEBUG,"Upload %s: %llu bytes, status %d", u->path, u->size, status);
+    if (server->upload_cb) server->upload_cb((ServerHandle*)server, c->id, u->path, u->size, status);
+}
+
+static void upload_free(struct Server* server, struct mg_connection* c, int status) {
+    struct Upload* u = UPLOAD_OF(c);
+    if (u == NULL) return;
+    upload_finish(server, c, u, status);
+    mg_iobuf_free(&u->pending);
+    free(u);
+    UPLOAD_OF(c) = NULL;
+}
+
+static int upload_open(struct Server* server, struct Upload* u, struct mg_str name, long offset) {
+    size_t cur = 0;
+    if (name.len == 0 || name.len >= sizeof(u->path) || name.buf[0] == '/' || name.buf[0] == '\\' ||
+        memchr(name.buf, ':', name.len) != NULL || !mg_path_is_sane(name)) {
+        return -2;
+    }
+    mg_snprintf(u->path, sizeof(u->path), "%s%c%.*s", server->upload_dir, MG_DIRSEP, (int)name.len, name.buf);
+    if (offset > 0 && (!mg_fs_posix.st(u->path, &cur, NULL) || cur != (size_t)offset)) return -5;
+    if ((u->wbuf = (char*)malloc(UPLOAD_WRITE_BUF)) == NULL) return -6;
+    if ((u->fp = fopen(u->path, offset > 0 ? "ab" : "wb")) == NULL) {
+        free(u->wbuf);
+        u->wbuf = NULL;
+        return -6;
+    }
+    setvbuf(u->fp, u->wbuf, _IOFBF, UPLOAD_WRITE_BUF);
+    u->size = 0;
+    u->offset = offset;
+    return 0;
+}
+
+static int upload_write(struct Server* server, struct Upload* u, const char* buf, size_t len) {
+    if (len == 0) return 0;
+    if (u->fp == NULL) return 0;  // multipart 中的普通字段，丢弃
+    u->size += len;
+    if (server->upload_max > 0 && u->size > server->upload_max) return -4;
+    return fwrite(buf, 1, len, u->fp) == len ? 0 : -1;
+}
+
+// 在 multipart 头部中取 filename，只保留文件名部分
+static struct mg_str upload_part_name(struct mg_str head) {
+    const char* p = head.buf;
+    const char* end = head.buf + head.len;
+    struct mg_str name = mg_str_n(NULL, 0);
+    for (; p + 10 <= end; p++) {
+        if (mg_strcasecmp(mg_str_n(p, 10), mg_str("filename=\"")) == 0) {
+            const char* q = p + 10;
+            name.buf = (char*)q;
+            while (q < end && *q != '"') q++;
+            name.len = (size_t)(q - name.buf);
+            break;
+        }
+    }
+    for (p = name.buf + name.len; name.len > 0 && p > name.buf; p--) {
+        if (p[-1] == '/' || p[-1] == '\\') {
+            name.len -= (size_t)(p - name.buf), name.buf = (char*)p;
+            break;
+        }
+    }
+    return name;
+}
+
+static const char* upload_find(const char* s, size_t n, const char* pat, size_t plen) {
+    const char* end = s + n;
+    while (n >= plen && (s = (const char*)memchr(s, pat[0], (size_t)(end - s - plen + 1))) != NULL) {
+        if (memcmp(s, pat, plen) == 0) return s;
+        s++, n = (size_t)(end - s);
+    }
+    return NULL;
+}
+
+// 处理 multipart 数据：pending 从 "--boundary" 或文件内容开始
+static int upload_multipart(struct Server* server, struct mg_connection* c, struct Upload* u) {
+    struct mg_iobuf* io = &u->pending;
+    for (;;) {
+        const char* s = (const char*)io->buf;
+        if (u->done) {
+            io->len = 0;  // 结束分隔符之后的内容忽略
+            return 0;
+        }
+        if (!u->in_part) {
+            // 分隔符行 + 部分头部，以空行结束
+            const char* hend = upload_find(s, io->len, "\r\n\r\n", 4);
+            size_t dlen = u->blen - 2;  // 不含前导 \r\n
+            if (io->len >= dlen + 2 && memcmp(s, u->boundary + 2, dlen) == 0 && memcmp(s + dlen, "--", 2) == 0) {
+                u->done = 1;
+                continue;
+            }
+            if (hend == NULL) return io->len > 8192 ? -3 : 0;  // 头部过长视为非法
+            if (io->len < dlen || memcmp(s, u->boundary + 2, dlen) != 0) return -3;
+            struct mg_str name = upload_part_name(mg_str_n(s, (size_t)(hend - s)));
+            if (name.len > 0) {
+                int rc = upload_open(server, u, name, 0);
+                if (rc != 0) return rc;
+            }
+            u->in_part = 1;
+            mg_iobuf_del(io, 0, (size_t)(hend + 4 - s));
+        } else {
+            const char* b = upload_find(s, io->len, u->boundary, u->blen);
+            size_t n = b ? (size_t)(b - s) : (io->len > u->blen ? io->len - u->blen : 0);
+            int rc = upload_write(server, u, s, n);
+            if (rc != 0) return rc;
+            mg_iobuf_del(io, 0, b ? n + 2 : n);  // 保留 "--boundary" 供下一部分解析
+            if (b == NULL) return 0;
+            u->in_part = 0;
+            upload_finish(server, c, u, 0);
+        }
+    }
+}
+
+static void upload_fail(struct Server* server, struct mg_connection* c, int rc) {
+    static const char* msg[] = {"", "write error", "invalid file", "bad multipart", "over max size", "offset mismatch", "open error"};
+    struct Upload* u = UPLOAD_OF(c);
+    mg_http_reply(c, rc == -4 ? 413 : rc == -1 || rc == -6 ? 500 : 400, "", "%s: %s\n", u && u->path[0] ? u->path : "upload", msg[-rc]);
+    upload_free(server, c, rc);
+    c->is_draining = 1;  // 剩余请求体不再接收
+}
+
+// MG_EV_HTTP_HDRS：匹配上传路由时开始分段接收
+static void upload_begin(struct Server* server, struct mg_connection* c, struct mg_http_message* hm) {
+    size_t plen = strlen(server->upload_prefix);
+    struct mg_str* ct = mg_http_get_header(hm, "Content-Type");
+    struct Upload* u;
+    char file[MG_PATH_MAX], buf[20] = "0";
+    int rc = 0;
+    if (hm->uri.len < plen || memcmp(hm->uri.buf, server->upload_prefix, plen) != 0) return;
+    if (server->upload_max > 0 && hm->body.len != (size_t)~0 && hm->body.len > server->upload_max) {
+        mg_http_reply(c, 413, "", "over max size of %llu\n", server->upload_max);
+        c->is_draining = 1;
+        return;
+    }
+    if ((u = (struct Upload*)calloc(1, sizeof(*u))) == NULL) {
+        mg_error(c, "OOM");
+        return;
+    }
+    UPLOAD_OF(c) = u;
+    c->is_http_stream = 1;
+    if (ct != NULL && ct->len >= 19 && mg_strcasecmp(mg_str_n(ct->buf, 19), mg_str("multipart/form-data")) == 0) {
+        struct mg_str b = mg_http_get_header_var(*ct, mg_str("boundary"));
+        if (b.len == 0 || b.len + 4 > sizeof(u->boundary)) {
+            rc = -3;
+        } else {
+            u->blen = (size_t)mg_snprintf(u->boundary, sizeof(u->boundary), "\r\n--%.*s", (int)b.len, b.buf);
+        }
+    } else {
+        // 整个请求体即文件内容：文件名取 ?file=，否则取 URI 中前缀之后的部分
+        int n = mg_http_get_var(&hm->query, "file", file, sizeof(file));
+        if (n <= 0) {
+            const char* p = hm->uri.buf + plen;
+            while (p < hm->uri.buf + hm->uri.len && *p == '/') p++;
+            n = mg_url_decode(p, (size_t)(hm->uri.buf + hm->uri.len - p), file, sizeof(file), 0);
+        }
+        mg_http_get_var(&hm->query, "offset", buf, sizeof(buf));
+        rc = n <= 0 ? -2 : upload_open(server, u, mg_str_n(file, (size_t)n), strtol(buf, NULL, 0));
+    }
+    if (rc != 0) upload_fail(server, c, rc);
+}
+
+static void upload_chunk(struct Server* server, struct mg_connection* c, struct mg_str chunk) {
+    struct Upload* u = UPLOAD_OF(c);
+    int rc;
+    u->total += chunk.len;
+    if (u->blen == 0) {
+        rc = upload_write(server, u, chunk.buf, chunk.len);
+    } else if (!mg_iobuf_add(&u->pending, u->pending.len, chunk.buf, chunk.len)) {
+        rc = -1;
+    } else {
+        rc = upload_multipart(server, c, u);
+    }
+    if (rc != 0) upload_fail(server, c, rc);
+}
+
+static void upload_end(struct Server* server, struct mg_connection* c) {
+    struct Upload* u = UPLOAD_OF(c);
+    // 与 mg_http_upload 一致：直传时回复文件当前大小，multipart 回复请求体字节数
+    unsigned long long n = u->blen > 0 ? u->total : (unsigned long long)u->offset + u->size;
+    if (u->blen > 0 && !u->done) {
+        upload_fail(server, c, -3);
+        return;
+    }
+    upload_free(server, c, 0);
+    mg_http_reply(c, 200, "", "%llu\n", n);
+}
+
+#define IP_TABLE_MIN 1024
+#define IP_RATE_MAX 4000000  // 令牌桶容量为 1 秒的量，须放得进 uint32_t
+
+static uint32_t ip_hash(const struct mg_addr* a) {
+    uint32_t h = 2166136261U;
+    size_t i, n = a->is_ip6 ? 16 : 4;
+    for (i = 0; i < n; i++) h = (h ^ a->ip[i]) * 16777619U;
+    return h;
+}
+
+static struct IpEntry* ip_slot(struct IpTable* t, const struct mg_addr* a) {
+    size_t i = ip_hash(a) & (t->cap - 1);
+    size_t n = a->is_ip6 ? 16 : 4;
+    while (t->slots[i].used && (t->slots[i].is_ip6 != a->is_ip6 || memcmp(t->slots[i].ip, a->ip, n) != 0)) {
+        i = (i + 1) & (t->cap - 1);
+    }
+    return &t->slots[i];
+}
+
+static uint32_t ip_rate(int rate) {
+    return rate > IP_RATE_MAX ? IP_RATE_MAX : (uint32_t)rate;
+}
+
+// 按经过的时间补充令牌，桶满且无连接的项可以回收
+static void ip_refill(const struct Server* server, struct IpEntry* e, uint32_t now) {
+    uint64_t dt = (uint32_t)(now - e->last);
+    uint32_t cr = ip_rate(server->config.ip_conn_rate), rr = ip_rate(server->config.ip_req_rate);
+    uint64_t ct = e->conn_tokens + dt * cr, rt = e->req_tokens + dt * rr;
+    e->conn_tokens = (uint32_t)(ct > cr * 1000ULL ? cr * 1000ULL : ct);
+    e->req_tokens = (uint32_t)(rt > rr * 1000ULL ? rr * 1000ULL : rt);
+    e->last = now;
+}
+
+static int ip_idle(const struct Server* server, const struct IpEntry* e) {
+    return e->conns == 0 && e->conn_tokens == ip_rate(server->config.ip_conn_rate) * 1000U &&
+           e->req_tokens == ip_rate(server->config.ip_req_rate) * 1000U;
+}
+
+// 重建哈希表：丢弃空闲项，仍超过一半时扩容
+static int ip_rehash(struct Server* server, uint32_t now) {
+    struct IpTable* t = &server->ips;
+    struct IpTable nt;
+    size_t i, live = 0;
+    for (i = 0; i < t->cap; i++) {
+        if (!t->slots[i].used) continue;
+        ip_refill(server, &t->slots[i], now);
+        if (!ip_idle(server, &t->slots[i])) live++;
+    }
+    nt.cap = t->cap;
+    while (live * 2 >= nt.cap) nt.cap *= 2;
+    nt.count = live;
+    if ((nt.slots = (struct IpEntry*)calloc(nt.cap, sizeof(struct IpEntry))) == NULL) return -1;
+    for (i = 0; i < t->cap; i++) {
+        struct IpEntry* e = &t->slots[i];
+        struct mg_addr a;
+        if (!e->used || ip_idle(server, e)) continue;
+        memcpy(a.ip, e->ip, sizeof(a.ip));
+        a.is_ip6 = e->is_ip6;
+        *ip_slot(&nt, &a) = *e;
+    }
+    free(t->slots);
+    *t = nt;
+    return 0;
+}
+
+static struct IpEntry* ip_entry(struct Server* server, const struct mg_addr* a) {
+    struct IpTable* t = &server->ips;
+    uint32_t now = (uint32_t)mg_millis();
+    struct IpEntry* e = ip_slot(t, a);
+    if (!e->used) {
+        if ((t->count + 1) * 2 > t->cap) {
+            if (ip_rehash(server, now) != 0) return NULL;
+            e = ip_slot(t, a);
+        }
+        memset(e, 0, sizeof(*e));
+        memcpy(e->ip, a->ip, a->is_ip6 ? 16 : 4);
+        e->is_ip6 = a->is_ip6;
+        e->used = 1;
+        e->last = now;
+        e->conn_tokens = ip_rate(server->config.ip_conn_rate) * 1000U;
+        e->req_tokens = ip_rate(server->config.ip_req_rate) * 1000U;
+        t->count++;
+    }
+    ip_refill(server, e, now);
+    return e;
+}
+
+// mgr.accept_fn：在分配连接对象之前按新建速率和并发数拒绝
+static bool ip_admit(struct mg_mgr* mgr, const struct mg_addr* a) {
+    struct Server* server = (struct Server*)mgr->userdata;
+    struct IpEntry* e = ip_entry(server, a);
+    if (e == NULL) return true;
+    if ((server->config.ip_max_conns > 0 && e->conns >= (uint32_t)server->config.ip_max_conns) ||
+        (server->config.ip_conn_rate > 0 && e->conn_tokens < 1000)) {
+        server->stats.ip_refused_conns++;
+        return false;
+    }
+    if (server->config.ip_conn_rate > 0) e->conn_tokens -= 1000;
+    return true;
+}
+
+static void ip_conn_count(struct Server* server, struct mg_connection* c, int delta) {
+    struct IpEntry* e = ip_entry(server, &c->rem);
+    if (e != NULL && (delta > 0 || e->conns > 0)) e->conns += (uint32_t)delta;
+}
+
+// 请求令牌不足时返回 1
+static int ip_limited(struct Server* server, struct mg_connection* c) {
+    struct IpEntry* e;
+    if (server->config.ip_req_rate <= 0 || (e = ip_entry(server, &c->rem)) == NULL) return 0;
+    if (e->req_tokens < 1000) return 1;
+    e->req_tokens -= 1000;
+    return 0;
+}
+
+#define CACHE_MAX_BYTES (16 * 1024 * 1024)
+#define CACHE_TABLE_MIN 256
+#define CACHE_KEY_MAX 1024
+
+static uint32_t cache_hash(const char* s, size_t n) {
+    uint32_t h = 2166136261U;
+    while (n-- > 0) h = (h ^ (uint8_t)*s++) * 16777619U;
+    return h;
+}
+
+// 返回指向条目（或链尾）的指针，便于摘除
+static struct CacheEntry** cache_find(struct Cache* t, const char* key, size_t n) {
+    uint32_t h = cache_hash(key, n);
+    struct CacheEntry** pe = &t->slots[h & (t->cap - 1)];
+    while (*pe != NULL && ((*pe)->hash != h || (*pe)->key_len != n || memcmp((*pe)->key, key, n) != 0)) {
+        pe = &(*pe)->next;
+    }
+    return pe;
+}
+
+static void cache_drop(struct Cache* t, struct CacheEntry** pe) {
+    struct CacheEntry* e = *pe;
+    *pe = e->next;
+    t->count--;
+    t->bytes -= e->size;
+    shared_payload_release(e->resp);  // 正在发送的连接仍持有各自的引用
+    free(e);
+}
+
+static void cache_free(struct Cache* t) {
+    size_t i;
+    for (i = 0; i < t->cap; i++) {
+        while (t->slots[i] != NULL) cache_drop(t, &t->slots[i]);
+    }
+    free(t->slots);
+    t->slots = NULL;
+    t->cap = t->count = t->bytes = 0;
+}
+
+static int cache_grow(struct Cache* t) {
+    size_t i, cap = t->cap ? t->cap * 2 : CACHE_TABLE_MIN;
+    struct CacheEntry** slots = (struct CacheEntry**)calloc(cap, sizeof(*slots));
+    if (slots == NULL) return -1;
+    for (i = 0; i < t->cap; i++) {
+        struct CacheEntry* e;
+        while ((e = t->slots[i]) != NULL) {
+            t->slots[i] = e->next;
+            e->next = slots[e->hash & (cap - 1)];
+            slots[e->hash & (cap - 1)] = e;
+        }
+    }
+    free(t->slots);
+    t->slots = slots;
+    t->cap = cap;
+    return 0;
+}
+
+// 先丢弃已失效的条目，仍放不下时依次丢弃最早失效的
+static void cache_evict(struct Server* server, size_t need, size_t max, uint64_t now) {
+    struct Cache* t = &server->cache;
+    struct CacheEntry **pe, **victim;
+    size_t i;
+    for (i = 0; i < t->cap; i++) {
+        for (pe = &t->slots[i]; *pe != NULL;) {
+            if (now >= (*pe)->stale_until) cache_drop(t, pe);
+            else pe = &(*pe)->next;
+        }
+    }
+    while (t->count > 0 && t->bytes + need > max) {
+        victim = NULL;
+        for (i = 0; i < t->cap; i++) {
+            for (pe = &t->slots[i]; *pe != NULL; pe = &(*pe)->next) {
+                if (victim == NULL || (*pe)->stale_until < (*victim)->stale_until) victim = pe;
+            }
+        }
+        cache_drop(t, victim);
+        server->stats.cache_evictions++;
+    }
+}
+
+// 加入条目，替换同键的旧条目。resp 为 NULL 时是 vary 记录，保存 vary 规则
+static int cache_insert(struct Server* server, const char* key, size_t n, struct SharedPayload* resp,
+                        const char* vary, uint64_t expires, uint64_t stale_until) {
+    struct Cache* t = &server->cache;
+    size_t vlen = resp ? 0 : strlen(vary) + 1;
+    size_t size = sizeof(struct CacheEntry) + n + 1 + vlen + (resp ? resp->len : 0);
+    size_t max = server->config.cache_max_bytes > 0 ? (size_t)server->config.cache_max_bytes : CACHE_MAX_BYTES;
+    struct CacheEntry **pe, *e;
+    if (size > max) return -1;
+    if (t->slots == NULL && cache_grow(t) != 0) return -1;
+    if (*(pe = cache_find(t, key, n)) != NULL) cache_drop(t, pe);
+    if (t->bytes + size > max) cache_evict(server, size, max, mg_millis());
+    if (t->count >= t->cap && cache_grow(t) != 0) return -1;
+    if ((e = (struct CacheEntry*)malloc(sizeof(*e) + n + 1 + vlen)) == NULL) return -1;
+    memcpy(e->key, key, n);
+    e->key[n] = '\0';
+    if (vlen > 0) memcpy(e->key + n + 1, vary, vlen);
+    if ((e->resp = resp) != NULL) resp->refs++;
+    e->expires = expires;
+    e->stale_until = stale_until;
+    e->hash = cache_hash(key, n);
+    e->refreshing = 0;
+    e->key_len = n;
+    e->size = size;
+    e->next = t->slots[e->hash & (t->cap - 1)];
+    t->slots[e->hash & (t->cap - 1)] = e;
+    t->count++;
+    t->bytes += size;
+    return 0;
+}
+
+// 按 vary 规则拼出变体的键：URI、换行，再依次是查询串（规则中的 query）或各请求头的值，
+// 各以换行结尾。放不下时返回 0，不缓存
+static size_t cache_key(struct mg_http_message* hm, const char* vary, char* buf, size_t size) {
+    struct mg_str v = mg_str(vary), tok, val, *hv;
+    size_t n = hm->uri.len;
+    char name[64];
+    if (n + 1 > size) return 0;
+    memcpy(buf, hm->uri.buf, n);
+    buf[n++] = '\n';
+    while (mg_span(v, &tok, &v, ',')) {
+        while (tok.len > 0 && tok.buf[0] == ' ') tok.buf++, tok.len--;
+        while (tok.len > 0 && tok.buf[tok.len - 1] == ' ') tok.len--;
+        if (tok.len == 0) continue;
+        if (mg_strcasecmp(tok, mg_str("query")) == 0) {
+            val = hm->query;
+        } else {
+            if (tok.len >= sizeof(name)) return 0;
+            memcpy(name, tok.buf, tok.len);
+            name[tok.len] = '\0';
+            hv = mg_http_get_header(hm, name);
+            val = hv ? *hv : mg_str("");
+        }
+        if (n + val.len + 1 > size) return 0;
+        if (val.len > 0) memcpy(buf + n, val.buf, val.len);
+        n += val.len;
+        buf[n++] = '\n';
+    }
+    return n;
+}
+
+// 查找请求对应的响应，未缓存或已失效时返回 NULL
+static struct CacheEntry* cache_lookup(struct Server* server, struct mg_http_message* hm, uint64_t now) {
+    struct Cache* t = &server->cache;
+    struct CacheEntry **pv, **pe;
+    char key[CACHE_KEY_MAX];
+    size_t n;
+    if (*(pv = cache_find(t, hm->uri.buf, hm->uri.len)) == NULL) return NULL;
+    if (now >= (*pv)->stale_until) {
+        cache_drop(t, pv);
+        return NULL;
+    }
+    if ((n = cache_key(hm, (*pv)->key + (*pv)->key_len + 1, key, sizeof(key))) == 0) return NULL;
+    if (*(pe = cache_find(t, key, n)) == NULL || (*pe)->resp == NULL) return NULL;
+    if (now >= (*pe)->stale_until) {
+        cache_drop(t, pe);
+        return NULL;
+    }
+    return *pe;
+}
+
+static void cache_refresh(void* arg);
+
+// 命中时直接回复并返回 1；过期但仍在 stale 期内的照常回复，并安排一次后台刷新
+static int cache_serve(struct Server* server, struct mg_connection* c, struct mg_http_message* hm) {
+    uint64_t now = mg_millis();
+    struct CacheEntry* e = cache_lookup(server, hm, now);
+    if (e == NULL) {
+        server->stats.cache_misses++;
+        return 0;
+    }
+    if (now < e->expires) {
+        server->stats.cache_hits++;
+    } else {
+        server->stats.cache_stale_hits++;
+        if (!e->refreshing) {
+            e->refreshing = 1;
+            if (!server->cache.armed) {
+                server->cache.armed = 1;
+                mg_timer_start(&server->mgr, &server->cache.refresh, 0, MG_TIMER_ONCE, cache_refresh, server);
+            }
+        }
+    }
+    e->resp->refs++;
+    mg_send_ref(c, e->resp->data, e->resp->len, shared_payload_release, e->resp);
+    c->is_resp = 0;
+    sendq_watch(server, c);
+    return 1;
+}
+
+// 序列化为完整的 HTTP 响应（状态行、头和正文），返回的副本由调用者持有一个引用
+static struct SharedPayload* http_payload(const HttpResponse* res) {
+    struct SharedPayload* p;
+    const char* headers = res->headers ? res->headers : "";
+    size_t blen = res->body ? strlen(res->body) : 0, hlen;
+    hlen = mg_snprintf(NULL, 0, "HTTP/1.1 %d %s\r\n%sContent-Length: %lu\r\n\r\n", res->status_code,
+                       mg_http_status_code_str(res->status_code), headers, (unsigned long)blen);
+    if ((p = (struct SharedPayload*)malloc(sizeof(*p) + hlen + blen + 1)) == NULL) return NULL;
+    mg_snprintf(p->data, hlen + 1, "HTTP/1.1 %d %s\r\n%sContent-Length: %lu\r\n\r\n", res->status_code,
+                mg_http_status_code_str(res->status_code), headers, (unsigned long)blen);
+    if (blen > 0) memcpy(p->data + hlen, res->body, blen);
+    p->len = hlen + blen;
+    p->key = NULL;
+    p->refs = 1;
+    return p;
+}
+
+// 以 key 保存响应，同时更新 URI 的 vary 记录
+static void cache_put(struct Server* server, const char* key, size_t n, struct SharedPayload* p,
+                      int ttl_ms, int stale_ms, const char* vary) {
+    struct CacheEntry** pv;
+    size_t ulen = (size_t)((const char*)memchr(key, '\n', n) - key);
+    uint64_t expires = mg_millis() + (uint64_t)ttl_ms, stale_until = expires + (uint64_t)stale_ms;
+    if (cache_insert(server, key, n, p, NULL, expires, stale_until) != 0) return;
+    pv = cache_find(&server->cache, key, ulen);
+    if (*pv != NULL && strcmp((*pv)->key + ulen + 1, vary) == 0) {
+        if ((*pv)->stale_until < stale_until) (*pv)->expires = (*pv)->stale_until = stale_until;
+    } else {
+        cache_insert(server, key, ulen, NULL, vary, stale_until, stale_until);
+    }
+}
+
+// 回调标记了可缓存时，序列化响应并以 key 保存。返回的响应由调用者持有一个引用；
+// 未标记或内存不足时返回 NULL
+static struct SharedPayload* cache_store(struct Server* server, const char* key, size_t n, const HttpResponse* res) {
+    struct Cache* t = &server->cache;
+    struct SharedPayload* p;
+    if (!t->marked || res->body == NULL || (p = http_payload(res)) == NULL) return NULL;
+    cache_put(server, key, n, p, t->ttl_ms, t->stale_ms, t->vary);
+    return p;
+}
+
+static void call_begin(struct Server* server, unsigned long long conn_id) {
+    server->cache.conn_id = conn_id;
+    server->cache.in_cb = 1;
+    server->cache.marked = 0;
+    server->cache.deferred = 0;
+}
+
+// 定时器：对过期但仍在回复的条目再调用一次 HttpCallback（conn_id 为 0），刷新缓存
+static void cache_refresh(void* arg) {
+    struct Server* server = (struct Server*)arg;
+    struct Cache* t = &server->cache;
+    char key[CACHE_KEY_MAX];
+    size_t i, n, cap;
+    t->armed = 0;
+    for (i = 0; i < t->cap && server->http_cb != NULL;) {
+        struct CacheEntry* e = t->slots[i];
+        while (e != NULL && !e->refreshing) e = e->next;
+        if (e == NULL) {
+            i++;
+            continue;
+        }
+        e->refreshing = 0;
+        memcpy(key, e->key, n = e->key_len);
+        cap = t->cap;
+        HttpRequest req = {
+            .method = "GET",
+            .uri = key,
+            .uri_len = (size_t)((const char*)memchr(key, '\n', n) - key),
+            .headers = NULL,
+            .body = NULL,
+            .body_len = 0
+        };
+        HttpResponse res = {0};
+        call_begin(server, 0);
+        server->http_cb((ServerHandle*)server, 0, &req, &res);
+        t->in_cb = 0;
+        server->stats.cache_refreshes++;
+        shared_payload_release(cache_store(server, key, n, &res));
+        free((void*)res.body);
+        if (t->cap != cap) i = 0;  // 扩容后条目换了桶，从头再找
+    }
+}
+
+// 合并键：方法、空格，再按 coalesce_vary 拼出与缓存键相同格式的部分
+static size_t flight_key(struct Server* server, struct mg_http_message* hm, char* buf, size_t size) {
+    size_t n = hm->method.len + 1, k;
+    const char* vary = server->config.coalesce_vary ? server->config.coalesce_vary : "";
+    if (n >= size) return 0;
+    memcpy(buf, hm->method.buf, hm->method.len);
+    buf[n - 1] = ' ';
+    k = cache_key(hm, vary, buf + n, size - n);
+    return k > 0 ? n + k : 0;
+}
+
+static void flight_free(struct Flight** pf) {
+    struct Flight* f = *pf;
+    *pf = f->next;
+    free(f->waiters);
+    free(f);
+}
+
+static void flight_send(struct Server* server, struct mg_connection* c, struct SharedPayload* p) {
+    p->refs++;
+    mg_send_ref(c, p->data, p->len, shared_payload_release, p);
+    c->is_resp = 0;  // 其后流水线中的请求在下一次轮询时继续处理
+    sendq_watch(server, c);
+}
+
+// 定时器：到期的等待连接回复 504，再按剩余等待中最早的截止时间，在回调内重新启动同一个定时器
+static void flight_expire(void* arg) {
+    struct Server* server = (struct Server*)arg;
+    struct Flight** pf;
+    uint64_t now = mg_millis(), next = (uint64_t)-1;
+    size_t i, j;
+    server->flight_armed = 0;
+    for (pf = &server->flights; *pf != NULL;) {
+        struct Flight* f = *pf;
+        for (i = j = 0; i < f->n; i++) {
+            if (now >= f->waiters[i].deadline) {
+                mg_http_reply(f->waiters[i].c, 504, "", "Gateway Timeout\n");
+                sendq_watch(server, f->waiters[i].c);
+                server->stats.coalesce_timeouts++;
+            } else {
+                if (f->waiters[i].deadline < next) next = f->waiters[i].deadline;
+                f->waiters[j++] = f->waiters[i];
+            }
+        }
+        f->n = j;
+        if (f->lc == NULL && f->n == 0) flight_free(pf);
+        else pf = &f->next;
+    }
+    if (next != (uint64_t)-1) {
+        server->flight_armed = 1;
+        mg_timer_start(&server->mgr, &server->flight_timer, next - now, MG_TIMER_ONCE, flight_expire, server);
+    }
+}
+
+// 已有相同的请求在等待回复时加入等待并返回 1，不再调用 HttpCallback
+static int flight_join(struct Server* server, struct mg_connection* c, struct mg_http_message* hm) {
+    struct Flight* f;
+    char key[CACHE_KEY_MAX];
+    size_t n;
+    if (server->flights == NULL || (n = flight_key(server, hm, key, sizeof(key))) == 0) return 0;
+    for (f = server->flights; f != NULL; f = f->next) {
+        if (f->key_len == n && memcmp(f->key, key, n) == 0) break;
+    }
+    if (f == NULL) return 0;
+    if (f->n == f->cap) {
+        size_t cap = f->cap ? f->cap * 2 : 8;
+        struct Waiter* w = (struct Waiter*)realloc(f->waiters, cap * sizeof(*w));
+        if (w == NULL) return 0;
+        f->waiters = w;
+        f->cap = cap;
+    }
+    f->waiters[f->n].c = c;
+    f->waiters[f->n++].deadline = mg_millis() + (uint64_t)server->config.coalesce_timeout_ms;
+    if (!server->flight_armed) {
+        server->flight_armed = 1;
+        mg_timer_start(&server->mgr, &server->flight_timer, (uint64_t)server->config.coalesce_timeout_ms,
+                       MG_TIMER_ONCE, flight_expire, server);
+    }
+    return 1;
+}
+
+// 回调推迟了回复：记下请求，供相同的请求等待；标记了可缓存时一并记下缓存键
+static void flight_begin(struct Server* server, struct mg_connection* c, struct mg_http_message* hm) {
+    struct Flight* f;
+    struct Cache* t = &server->cache;
+    char key[CACHE_KEY_MAX], ckey[CACHE_KEY_MAX];
+    size_t n = 0, cn = 0, vlen = strlen(t->vary) + 1;
+    if (server->config.coalesce_timeout_ms > 0) n = flight_key(server, hm, key, sizeof(key));
+    if (t->marked) cn = cache_key(hm, t->vary, ckey, sizeof(ckey));
+    if (n == 0 && cn == 0) return;
+    if ((f = (struct Flight*)calloc(1, sizeof(*f) + n + cn + vlen)) == NULL) return;
+    memcpy(f->key, key, n);
+    memcpy(f->key + n, ckey, cn);
+    memcpy(f->key + n + cn, t->vary, vlen);
+    f->key_len = n;
+    f->ckey_len = cn;
+    f->ttl_ms = t->ttl_ms;
+    f->stale_ms = t->stale_ms;
+    f->leader = c->id;
+    f->lc = c;
+    f->next = server->flights;
+    server->flights = f;
+}
+
+// 推迟的回复到达：只序列化一次，按引用发给发起请求和等待中的所有连接
+static int flight_finish(struct Server* server, struct Flight** pf, const HttpResponse* res) {
+    struct Flight* f = *pf;
+    struct SharedPayload* p = http_payload(res);
+    size_t i;
+    int rc = f->lc != NULL || f->n > 0 ? 0 : -1;
+    if (p == NULL) return -1;
+    if (f->ckey_len > 0 && res->body != NULL) {
+        cache_put(server, f->key + f->key_len, f->ckey_len, p, f->ttl_ms, f->stale_ms,
+                  f->key + f->key_len + f->ckey_len);
+    }
+    if (f->lc != NULL) flight_send(server, f->lc, p);
+    for (i = 0; i < f->n; i++) flight_send(server, f->waiters[i].c, p);
+    server->stats.coalesced_requests += f->n;
+    flight_free(pf);
+    shared_payload_release(p);
+    return rc;
+}
+
+// 连接断开：不再等待。推迟回复的连接断开后，回复仍会送达等待的连接
+static void flight_forget(struct Server* server, struct mg_connection* c) {
+    struct Flight** pf;
+    size_t i, j;
+    for (pf = &server->flights; *pf != NULL;) {
+        struct Flight* f = *pf;
+        if (f->lc == c) f->lc = NULL;
+        for (i = j = 0; i < f->n; i++) {
+            if (f->waiters[i].c != c) f->waiters[j++] = f->waiters[i];
+        }
+        f->n = j;
+        if (f->lc == NULL && f->n == 0) flight_free(pf);
+        else pf = &f->next;
+    }
+}
 
 static void fn(struct mg_connection* c, int ev, void* ev_data) {
     struct Server* server = (struct Server*)c->mgr->userdata;
@@ -50,6 +1087,9 @@ static void fn(struct mg_connection* c, int ev, void* ev_data) {
     if (ev == MG_EV_OPEN) {
         LOG(LOG_LEVEL_DEBUG,"MG_EV_OPEN: %llu", (unsigned long long)c->id);
         if (g_log_level==LOG_LEVEL_DEBUG) c->is_hexdumping = 1;
+        if (c->is_accepted && server->ips.slots) ip_conn_count(server, c, 1);
+        sendq_limits(CONN_DATA(c), (unsigned int)server->config.send_high_water,
+                     (unsigned int)server->config.send_low_water);
     } else if (ev == MG_EV_ACCEPT && server->config.use_tls) {
         LOG(LOG_LEVEL_DEBUG,"MG_EV_ACCEPT: %llu", (unsigned long long)c->id);
         struct mg_str cert = mg_file_read(&mg_fs_posix, server->config.cert_file);
@@ -57,21 +1097,70 @@ static void fn(struct mg_connection* c, int ev, void* ev_data) {
         if (cert.len == 0 || key.len == 0) {
             LOG(LOG_LEVEL_ERROR,"Failed to read TLS certificate files - cert: %s, key: %s", server->config.cert_file, server->config.key_file);
             c->is_closing = 1;
+            mg_conn_activate(c);
         }
         struct mg_tls_opts opts = {.cert = cert, .key = key};
         mg_tls_init(c, &opts);
         LOG(LOG_LEVEL_DEBUG,"TLS initialization attempted for connection from %s:%d", c->loc.ip, c->loc.port);
+    } else if (ev == MG_EV_HTTP_HDRS) {
+        // 按路由或 Content-Length 决定是否分段交付请求体，请求体不再整体缓存在接收缓冲中
+        struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+        if (server->ips.slots && c->is_accepted && ip_limited(server, c)) {
+            server->stats.ip_limited_requests++;
+            mg_http_reply(c, 429, "Retry-After: 1\r\n", "Too Many Requests\n");
+            c->is_draining = 1;  // 不再读取请求体，也不调用 HttpCallback
+            return;
+        }
+        if (server->upload_prefix && c->is_accepted && !c->is_http_stream && UPLOAD_OF(c) == NULL) {
+            upload_begin(server, c, hm);
+        }
+        if (server->body_cb && c->is_accepted && !c->is_http_stream && !c->is_draining) {
+            size_t plen = server->body_prefix ? strlen(server->body_prefix) : 0;
+            if ((plen > 0 && hm->uri.len >= plen && memcmp(hm->uri.buf, server->body_prefix, plen) == 0) ||
+                (server->config.http_stream_min > 0 && hm->body.len != (size_t)~0 &&
+                 hm->body.len >= (size_t)server->config.http_stream_min)) {
+                c->is_http_stream = 1;
+            }
+        }
+    } else if (ev == MG_EV_HTTP_CHUNK) {
+        struct mg_http_message* hm = (struct mg_http_message*)ev_data;
+        if (UPLOAD_OF(c) != NULL || c->is_draining) {
+            if (!c->is_draining) upload_chunk(server, c, hm->chunk);
+            return;
+        }
+        HttpRequest req = {
+            .method = "POST",
+            .uri = hm->uri.buf,
+            .uri_len = hm->uri.len,
+            .headers = NULL,
+            .body = NULL,
+            .body_len = 0
+        };
+        server->body_cb((ServerHandle*)server, c->id, &req, hm->chunk.buf, hm->chunk.len, c->rx_body);
     } else if (ev == MG_EV_HTTP_MSG) {
         struct mg_http_message* hm = (struct mg_http_message*)ev_data;
         LOG(LOG_LEVEL_DEBUG,"MG_EV_HTTP_MSG: %llu, URI: %.*s", (unsigned long long)c->id, (int)hm->uri.len, hm->uri.buf);
+        if (UPLOAD_OF(c) != NULL) {
+            upload_end(server, c);
+            return;
+        }
+        if (c->is_draining) return;  // 上传已出错并回复
         // 检查是否为 WebSocket 升级请求
         if (mg_match(hm->uri, mg_str("/ws"), NULL) &&
             server->config.enable_ws && // 仅在启用 WebSocket 时处理
             mg_http_get_header(hm, "Upgrade") != NULL) {
             mg_ws_upgrade(c, hm, NULL);
+            if (server->config.ws_stream) c->is_ws_stream = 1;
+            if (server->config.ws_ping_interval_ms > 0 && ws_state(c) != NULL) {
+                mg_timer_start(c->mgr, &WS_OF(c)->ping, (uint64_t)server->config.ws_ping_interval_ms,
+                               MG_TIMER_REPEAT, ws_keepalive, WS_OF(c));
+            }
             LOG(LOG_LEVEL_DEBUG,"Upgraded connection %llu to WebSocket", (unsigned long long)c->id);
             return;
         }
+        int cacheable = mg_strcmp(hm->method, mg_str("GET")) == 0;
+        if (server->http_cb && cacheable && server->cache.slots != NULL && cache_serve(server, c, hm)) return;
+        if (server->http_cb && cacheable && server->config.coalesce_timeout_ms > 0 && flight_join(server, c, hm)) return;
         if (server->http_cb) {
             HttpRequest req = {
                 .method = "GET",
@@ -83,30 +1172,66 @@ static void fn(struct mg_connection* c, int ev, void* ev_data) {
             };
             HttpResponse res = {0};
             LOG(LOG_LEVEL_DEBUG,"Calling http_cb for conn %llu", (unsigned long long)c->id);
+            call_begin(server, c->id);
             server->http_cb((ServerHandle*)server, c->id, &req, &res);
+            server->cache.in_cb = 0;
             LOG(LOG_LEVEL_DEBUG,"http_cb returned for conn %llu, status_code=%d", (unsigned long long)c->id, res.status_code);
-            if (res.body) {
-                mg_http_reply(c, res.status_code, res.headers, "%s", res.body);
-                LOG(LOG_LEVEL_DEBUG,"Sent HTTP 200 response to conn %llu", (unsigned long long)c->id);
+            struct SharedPayload* p = NULL;
+            if (res.body && server->cache.marked && cacheable) {
+                char key[CACHE_KEY_MAX];
+                size_t n = cache_key(hm, server->cache.vary, key, sizeof(key));
+                if (n > 0) p = cache_store(server, key, n, &res);
+            }
+            if (p != NULL) {
+                // 已序列化进缓存，从缓存的副本发送，引用交给连接
+                mg_send_ref(c, p->data, p->len, shared_payload_release, p);
+                c->is_resp = 0;
                 free((void*)res.body);
+            } else if (res.body) {
+                // body 由回调分配，直接从原内存发送，发送完成或连接关闭后再 free
+                mg_http_reply_ref(c, res.status_code, res.headers, res.body, strlen(res.body),
+                                  free, (void*)res.body);
+                LOG(LOG_LEVEL_DEBUG,"Sent HTTP 200 response to conn %llu", (unsigned long long)c->id);
+            } else if (server->cache.deferred) {
+                if (cacheable) flight_begin(server, c, hm);
+                LOG(LOG_LEVEL_DEBUG,"Deferred response to conn %llu", (unsigned long long)c->id);
+            } else if (CONN_DATA(c)->streaming) {
+                LOG(LOG_LEVEL_DEBUG,"Streaming response to conn %llu", (unsigned long long)c->id);
             } else {
                 struct mg_http_serve_opts opts = {.root_dir = server->config.root_dir};
                 mg_http_serve_dir(c, hm, &opts);
                 LOG(LOG_LEVEL_DEBUG,"Served static file for conn %llu", (unsigned long long)c->id);
             }
         }
+    } else if (ev == MG_EV_WRITE) {
+        slow_drain(server, c);
+        sendq_watch(server, c);
+        if (CONN_DATA(c)->streaming) stream_writable(server, c);
+    } else if (ev == MG_EV_POLL && CONN_DATA(c)->streaming) {
+        stream_writable(server, c);
     } else if (ev == MG_EV_TLS_HS) {
         LOG(LOG_LEVEL_DEBUG,"TLS handshake with %s:%d %s", c->loc.ip, c->loc.port, ev_data ? "succeeded" : "failed");
     } else if (ev == MG_EV_CLOSE) {
+        upload_free(server, c, -1);  // 上传未完成即断开
+        ws_free(c);
+        if (server->flights != NULL) flight_forget(server, c);
+        if (c->is_accepted && server->ips.slots) ip_conn_count(server, c, -1);
         LOG(LOG_LEVEL_DEBUG,"Connection closed from %s:%d, reason: %s", c->loc.ip, c->loc.port, ev_data ? (char*)ev_data : "normal");
+    } else if (ev == MG_EV_WS_CTL) {
+        struct mg_ws_message* wm = (struct mg_ws_message*)ev_data;
+        // pong（或对端的 ping）说明连接仍然可用
+        if (WS_OF(c) != NULL && (wm->flags & 15) != WEBSOCKET_OP_CLOSE) WS_OF(c)->last_seen = mg_millis();
     } else if (ev == MG_EV_WS_MSG) {
         struct mg_ws_message* wm = (struct mg_ws_message*)ev_data;
+        if (WS_OF(c) != NULL) WS_OF(c)->last_seen = mg_millis();
         LOG(LOG_LEVEL_DEBUG,"Received WebSocket message from connection %llu (length: %zu)", (unsigned long long)c->id, wm->data.len);
         if (server->ws_cb) {
             WsMessage wm_msg = {
                 .data = wm->data.buf,
                 .data_len = wm->data.len,
-                .binary = (wm->flags & WEBSOCKET_OP_BINARY) ? 1 : 0
+                .binary = (wm->flags & WEBSOCKET_OP_BINARY) ? 1 : 0,
+                .offset = wm->offset,
+                .final = wm->final ? 1 : 0
             };
             server->ws_cb((ServerHandle*)server, c->id, &wm_msg);
         }
@@ -132,6 +1257,11 @@ MG_SERVER_API void __stdcall Server_Destroy(ServerHandle* h) {
     if (h) {
         struct Server* server = (struct Server*)h;
         mg_mgr_free(&server->mgr);
+        free(server->body_prefix);
+        free(server->upload_prefix);
+        free(server->upload_dir);
+        free(server->ips.slots);
+        cache_free(&server->cache);
         free(server);
     }
 }
@@ -153,12 +1283,80 @@ MG_SERVER_API int __stdcall Server_SetCallbacks(ServerHandle* h, HttpCallback ht
     return 0;
 }
 
+MG_SERVER_API int __stdcall Server_SetBodyCallback(ServerHandle* h, HttpBodyCallback body_cb, const char* uri_prefix) {
+    if (!h) return -1;
+    struct Server* server = (struct Server*)h;
+    char* prefix = (uri_prefix && *uri_prefix) ? strdup(uri_prefix) : NULL;
+    if (uri_prefix && *uri_prefix && !prefix) return -1;
+    free(server->body_prefix);
+    server->body_prefix = prefix;
+    server->body_cb = body_cb;
+    return 0;
+}
+
+MG_SERVER_API int __stdcall Server_SetUploadRoute(ServerHandle* h, const char* uri_prefix, const char* target_dir,
+                                                  unsigned long long max_size, UploadCallback upload_cb) {
+    if (!h) return -1;
+    struct Server* server = (struct Server*)h;
+    char* prefix = NULL;
+    char* dir = NULL;
+    if (uri_prefix && *uri_prefix) {
+        if (!target_dir || !*target_dir) return -1;
+        prefix = strdup(uri_prefix);
+        dir = strdup(target_dir);
+        if (!prefix || !dir) {
+            free(prefix);
+            free(dir);
+            return -1;
+        }
+    }
+    free(server->upload_prefix);
+    free(server->upload_dir);
+    server->upload_prefix = prefix;  // uri_prefix 为 NULL 时取消上传路由
+    server->upload_dir = dir;
+    server->upload_max = max_size;
+    server->upload_cb = upload_cb;
+    return 0;
+}
+
 MG_SERVER_API int __stdcall Server_Start(ServerHandle* h) {
     if (!h) return -1;
     struct Server* server = (struct Server*)h;
     char addr[64];
     snprintf(addr, sizeof(addr), "%s://0.0.0.0:%d", server->config.use_tls ? "https" : "http", server->config.port);
     LOG(LOG_LEVEL_DEBUG,"Starting server on port %d, TLS: %s", server->config.port, server->config.use_tls ? "enabled" : "disabled");
+    if (server->config.listen_backlog > 0) server->mgr.listen_backlog = server->config.listen_backlog;
+    if (server->config.accept_batch > 0) server->mgr.accept_batch = server->config.accept_batch;
+    server->mgr.iobuf_growth = server->config.iobuf_growth;
+    server->mgr.scrub = server->config.scrub_buffers != 0;
+    server->mgr.ws_deflate.enabled = server->config.ws_deflate != 0;
+    server->mgr.ws_deflate.no_context_takeover = server->config.ws_deflate_no_context_takeover != 0;
+    server->mgr.ws_deflate.window_bits = server->config.ws_deflate_window_bits;
+    server->mgr.ws_deflate.mem_level = server->config.ws_deflate_mem_level;
+    server->mgr.ws_deflate.threshold = server->config.ws_deflate_threshold > 0 ? (size_t)server->config.ws_deflate_threshold : 64;
+#if !MG_ENABLE_WS_DEFLATE
+    if (server->config.ws_deflate) {
+        LOG(LOG_LEVEL_WARN,"permessage-deflate not compiled in (MG_ENABLE_WS_DEFLATE)");
+    }
+#endif
+#if MG_ENABLE_IO_URING
+    if (server->config.io_backend == IO_BACKEND_EPOLL) {
+        mg_io_uring_free(&server->mgr);
+    } else if (server->config.io_backend == IO_BACKEND_IO_URING && !mg_io_uring_init(&server->mgr)) {
+        LOG(LOG_LEVEL_WARN,"io_uring unavailable, using epoll");
+    }
+#else
+    if (server->config.io_backend == IO_BACKEND_IO_URING) {
+        LOG(LOG_LEVEL_WARN,"io_uring not compiled in (MG_ENABLE_IO_URING), using default backend");
+    }
+#endif
+    if ((server->config.ip_conn_rate > 0 || server->config.ip_max_conns > 0 || server->config.ip_req_rate > 0) &&
+        server->ips.slots == NULL) {
+        server->ips.slots = (struct IpEntry*)calloc(IP_TABLE_MIN, sizeof(struct IpEntry));
+        server->ips.cap = server->ips.slots ? IP_TABLE_MIN : 0;
+        server->ips.count = 0;
+    }
+    server->mgr.accept_fn = server->ips.slots ? ip_admit : NULL;
     server->listener = mg_http_listen(&server->mgr, addr, fn, server);
     if (server->listener) {
         LOG(LOG_LEVEL_DEBUG,"Listener created successfully on %s", addr);
@@ -179,15 +1377,17 @@ MG_SERVER_API void __stdcall Server_Stop(ServerHandle* h) {
             char addr[64];
             snprintf(addr, sizeof(addr), "%s:%d", c->loc.ip, c->loc.port);
             c->is_closing = 1; // 立即关闭所有连接
+            mg_conn_activate(c);
             LOG(LOG_LEVEL_DEBUG,"Closing connection %llu from %s", (unsigned long long)c->id, addr);
         }
+        server->listener = NULL;  // 监听连接随 mg_mgr_free 一并释放
         mg_mgr_free(&server->mgr); // 释放所有连接
+        cache_free(&server->cache);  // 定时器随 mgr 一并摘除，推迟的请求随连接关闭一并清除
+        server->cache.armed = 0;
+        server->flight_armed = 0;
+        mg_mgr_init(&server->mgr); // 可再次 Server_Start
+        server->mgr.userdata = server;
         LOG(LOG_LEVEL_DEBUG,"All connections closed, server stopped");
-        // 清理监听器   
-        if (server->listener) {
-            server->listener->is_closing = 1;
-            server->listener = NULL;
-        }
     }
 }
 
@@ -207,21 +1407,67 @@ MG_SERVER_API int __stdcall Server_WsSendToOne(ServerHandle* h, unsigned long lo
     for (c = server->mgr.conns; c; c = c->next) {
         if (c->id == conn_id && c->is_websocket) {
             mg_ws_send(c, wm->data, wm->data_len, wm->binary ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT);
+            sendq_watch(server, c);
             return 0;
         }
     }
     return -1;
 }
 
-MG_SERVER_API int __stdcall Server_WsBroadcast(ServerHandle* h, const WsMessage* wm) {
+// 压缩参数相同、且不保留上下文的连接，压缩结果相同，每种参数只压缩一次
+#define BROADCAST_ZIP_KEYS 4
+
+MG_SERVER_API int __stdcall Server_WsBroadcastKeyed(ServerHandle* h, const WsMessage* wm, const char* key) {
     if (!h || !wm || wm->data_len <= 0) return -1;
     struct Server* server = (struct Server*)h;
     struct mg_connection* c;
+    int op = wm->binary ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT;
+    size_t len = (size_t)wm->data_len;
+    struct SharedPayload* p = NULL;  // 短消息（或内存不足）时为 NULL，直接拷贝到各连接
+    struct SharedPayload* zp[BROADCAST_ZIP_KEYS];
+    int zkey[BROADCAST_ZIP_KEYS], nz = 0, i;
+    if (len >= MG_SEND_REF_MIN) p = shared_payload_new(wm->data, len, key);
     for (c = server->mgr.conns; c; c = c->next) {
-        if (c->is_websocket) {
-            mg_ws_send(c, wm->data, wm->data_len, wm->binary ? WEBSOCKET_OP_BINARY : WEBSOCKET_OP_TEXT);
+        if (!c->is_websocket || c->is_closing) continue;
+        struct SharedPayload* sp = p;
+        int sop = op, slow = 0;
+        if (server->config.slow_policy != SLOW_POLICY_NONE && (slow = slow_check(server, c)) < 0) continue;
+        int zk = mg_ws_deflate_key(c, len);
+        if (zk != 0) {
+            for (i = 0; i < nz && zkey[i] != zk; i++) continue;
+            if (i == nz && nz < BROADCAST_ZIP_KEYS) {
+                struct mg_str z = mg_ws_deflate(c, wm->data, len);
+                zkey[nz] = zk;
+                zp[nz++] = z.buf != NULL ? shared_payload_new(z.buf, z.len, key) : NULL;
+            }
+            if (i < nz && zp[i] != NULL) sp = zp[i], sop = op | WEBSOCKET_OP_DEFLATED;
+        }
+        if (slow > 0 && sp == NULL && p == NULL) sp = p = shared_payload_new(wm->data, len, key);
+        if (slow > 0 && sp != NULL) {
+            sp->refs++;
+            slow_hold(server, c, sp, sop);
+            continue;
+        }
+        if (sp != NULL) {
+            sp->refs++;
+            mg_ws_send_ref(c, sp->data, sp->len, sop, shared_payload_release, sp);
+        } else {
+            mg_ws_send(c, wm->data, len, op);
         }
+        sendq_watch(server, c);
     }
+    for (i = 0; i < nz; i++) shared_payload_release(zp[i]);
+    shared_payload_release(p);
+    return 0;
+}
+
+MG_SERVER_API int __stdcall Server_WsBroadcast(ServerHandle* h, const WsMessage* wm) {
+    return Server_WsBroadcastKeyed(h, wm, NULL);
+}
+
+MG_SERVER_API int __stdcall Server_GetStats(ServerHandle* h, ServerStats* stats) {
+    if (!h || !stats) return -1;
+    *stats = ((struct Server*)h)->stats;
     return 0;
 }
 
@@ -229,9 +1475,110 @@ MG_SERVER_API int __stdcall Server_HttpReply(ServerHandle* h, unsigned long long
     if (!h || !res) return -1;
     struct Server* server = (struct Server*)h;
     struct mg_connection* c;
+    struct Flight** pf;
+    for (pf = &server->flights; *pf != NULL && (*pf)->leader != conn_id; pf = &(*pf)->next) continue;
+    if (*pf != NULL) return flight_finish(server, pf, res);
     for (c = server->mgr.conns; c; c = c->next) {
         if (c->id == conn_id && !c->is_websocket) {
             mg_http_reply(c, res->status_code, res->headers ? res->headers : "", res->body);
+            sendq_watch(server, c);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+MG_SERVER_API int __stdcall Server_HttpCache(ServerHandle* h, unsigned long long conn_id, int ttl_ms, int stale_ms, const char* vary) {
+    if (!h || ttl_ms <= 0 || stale_ms < 0) return -1;
+    struct Server* server = (struct Server*)h;
+    struct Cache* t = &server->cache;
+    size_t vlen = vary ? strlen(vary) : 0;
+    if (!t->in_cb || t->conn_id != conn_id || vlen >= sizeof(t->vary)) return -1;
+    memcpy(t->vary, vary ? vary : "", vlen + 1);
+    t->ttl_ms = ttl_ms;
+    t->stale_ms = stale_ms;
+    t->marked = 1;
+    return 0;
+}
+
+MG_SERVER_API int __stdcall Server_HttpDefer(ServerHandle* h, unsigned long long conn_id) {
+    if (!h) return -1;
+    struct Cache* t = &((struct Server*)h)->cache;
+    if (!t->in_cb || t->conn_id != conn_id || conn_id == 0) return -1;
+    t->deferred = 1;
+    return 0;
+}
+
+static struct mg_connection* find_http_conn(struct Server* server, unsigned long long conn_id) {
+    struct mg_connection* c;
+    for (c = server->mgr.conns; c; c = c->next) {
+        if (c->id == conn_id && !c->is_websocket && !c->is_listening) return c;
+    }
+    return NULL;
+}
+
+MG_SERVER_API int __stdcall Server_HttpBeginStream(ServerHandle* h, unsigned long long conn_id, int status_code, const char* headers) {
+    if (!h) return -1;
+    struct Server* server = (struct Server*)h;
+    struct mg_connection* c = find_http_conn(server, conn_id);
+    if (!c || CONN_DATA(c)->streaming) return -1;
+    mg_printf(c, "HTTP/1.1 %d %s\r\n%sTransfer-Encoding: chunked\r\n\r\n", status_code,
+              mg_http_status_code_str(status_code), headers ? headers : "");
+    c->is_resp = 1;  // 结束前不处理同一连接上的后续请求
+    CONN_DATA(c)->streaming = 1;
+    return 0;
+}
+
+MG_SERVER_API int __stdcall Server_HttpWriteChunk(ServerHandle* h, unsigned long long conn_id, const char* data, size_t len) {
+    if (!h || (!data && len > 0)) return -1;
+    struct Server* server = (struct Server*)h;
+    struct mg_connection* c = find_http_conn(server, conn_id);
+    if (!c || !CONN_DATA(c)->streaming) return -1;
+    if (len > 0) mg_http_write_chunk(c, data, len);  // 空块表示结束，由 Server_HttpEndStream 发送
+    sendq_watch(server, c);
+    return 0;
+}
+
+MG_SERVER_API int __stdcall Server_HttpEndStream(ServerHandle* h, unsigned long long conn_id) {
+    if (!h) return -1;
+    struct Server* server = (struct Server*)h;
+    struct mg_connection* c = find_http_conn(server, conn_id);
+    if (!c || !CONN_DATA(c)->streaming) return -1;
+    mg_http_write_chunk(c, "", 0);
+    CONN_DATA(c)->streaming = 0;
+    return 0;
+}
+
+MG_SERVER_API int __stdcall Server_SetWritableCallback(ServerHandle* h, HttpWritableCallback writable_cb) {
+    if (!h) return -1;
+    ((struct Server*)h)->writable_cb = writable_cb;
+    return 0;
+}
+
+MG_SERVER_API long long __stdcall Server_GetSendQueueBytes(ServerHandle* h, unsigned long long conn_id) {
+    if (!h) return -1;
+    struct Server* server = (struct Server*)h;
+    struct mg_connection* c;
+    for (c = server->mgr.conns; c; c = c->next) {
+        if (c->id == conn_id && !c->is_listening) return (long long)mg_send_queued(c);
+    }
+    return -1;
+}
+
+MG_SERVER_API int __stdcall Server_SetSendQueueCallback(ServerHandle* h, SendQueueCallback sendq_cb) {
+    if (!h) return -1;
+    ((struct Server*)h)->sendq_cb = sendq_cb;
+    return 0;
+}
+
+MG_SERVER_API int __stdcall Server_SetConnWatermarks(ServerHandle* h, unsigned long long conn_id, unsigned int high, unsigned int low) {
+    if (!h) return -1;
+    struct Server* server = (struct Server*)h;
+    struct mg_connection* c;
+    for (c = server->mgr.conns; c; c = c->next) {
+        if (c->id == conn_id && !c->is_listening) {
+            sendq_limits(CONN_DATA(c), high, low);
+            sendq_watch(server, c);
             return 0;
         }
     }
@@ -263,6 +1610,21 @@ MG_SERVER_API int __stdcall Server_HttpServeFile(ServerHandle* h, unsigned long
     return -1;
 }
 
+MG_SERVER_API int __stdcall Server_GetPoolStats(ServerHandle* h, PoolStats* stats) {
+    if (!h || !stats) return -1;
+    struct Server* server = (struct Server*)h;
+    struct mg_pool* p = &server->mgr.pool;
+    int i;
+    memset(stats, 0, sizeof(*stats));
+    stats->conn_hits = p->conn_hits;
+    stats->conn_misses = p->conn_misses;
+    stats->buf_hits = p->buf_hits;
+    stats->buf_misses = p->buf_misses;
+    stats->free_conns = p->nconns;
+    for (i = 0; i < MG_POOL_CLASSES; i++) stats->free_bufs += p->nbufs[i];
+    return 0;
+}
+
 MG_SERVER_API void __stdcall Server_SetLogLevel(int enabled, LogLevel level) {
     g_log_enabled = enabled;
     g_log_level = level;
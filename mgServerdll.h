@@ -36,11 +36,24 @@ typedef struct {
     const char* data;     // 消息内容
     size_t data_len;      // 消息长度
     int binary;           // 1=二进制，0=文本
+    size_t offset;        // 分片交付时本段在整条消息中的偏移，否则为 0（发送时忽略）
+    int final;            // 1=消息的最后一段（未开启分片交付时恒为 1，发送时忽略）
     // 可扩展更多字段，如opcode、mask等
 } WsMessage;
 
 typedef void (__stdcall *HttpCallback)(ServerHandle* server, unsigned long long conn_id, const HttpRequest* request, HttpResponse* response);
 typedef void (__stdcall *WsCallback)(ServerHandle* server, unsigned long long conn_id, const WsMessage* message);
+// 请求体分段回调：data/len 为本段内容，offset 为本段在请求体中的偏移；请求体收完后照常调用 HttpCallback
+typedef void (__stdcall *HttpBodyCallback)(ServerHandle* server, unsigned long long conn_id, const HttpRequest* request,
+                                           const char* data, size_t len, size_t offset);
+
+// 流式响应可写回调：writable 为此刻还可写入而不致积压的字节数，待发送数据低于窗口一半时随轮询反复调用
+typedef void (__stdcall *HttpWritableCallback)(ServerHandle* server, unsigned long long conn_id, size_t writable);
+// 发送队列水位回调：above=1 表示待发送字节数越过高水位，above=0 表示已回落到低水位，可恢复生产
+typedef void (__stdcall *SendQueueCallback)(ServerHandle* server, unsigned long long conn_id, size_t queued, int above);
+// 上传完成回调：path 为写入的文件，size 为字节数，status 0=成功，<0=失败（文件已删除）
+typedef void (__stdcall *UploadCallback)(ServerHandle* server, unsigned long long conn_id, const char* path,
+                                         unsigned long long size, int status);
 
 typedef struct {
     int port;
@@ -49,8 +62,72 @@ typedef struct {
     const char* cert_file;
     const char* key_file;
     const char* root_dir;
+    int listen_backlog;   // listen() 队列长度，0=默认(128)
+    int accept_batch;     // 每次 Poll 最多接受的新连接数，0=默认(64)
+    int io_backend;       // I/O 后端，见 IoBackend，0=编译默认
+    int iobuf_growth;     // 收发缓冲扩容比例(%)，0=编译默认(100，即翻倍)，<0=按需线性扩容
+    int scrub_buffers;    // 1=收发缓冲在消费/释放时清零，0=仅清零 TLS 记录缓冲(默认)
+    int ws_deflate;       // 1=WebSocket 协商 permessage-deflate 压缩(需 MG_ENABLE_WS_DEFLATE 与 zlib)
+    int ws_deflate_window_bits;  // 压缩窗口 9..15，0=15
+    int ws_deflate_mem_level;    // zlib memLevel 1..9，0=8
+    int ws_deflate_threshold;    // 短于此字节数的消息不压缩，0=默认(64)
+    int ws_deflate_no_context_takeover;  // 1=每条消息独立压缩：省内存，且广播只压缩一次
+    int ws_stream;        // 1=WebSocket 消息边收边交付（带 offset/final），不在内存中拼整条消息
+    int http_stream_min;  // Content-Length 不小于此值的请求体分段交给 HttpBodyCallback，0=不按大小分段
+    int send_high_water;  // 每连接待发送字节数越过此值时调用 SendQueueCallback，0=不监视
+    int send_low_water;   // 回落到此值以下时再次调用，0=高水位的一半
+    int slow_policy;      // 广播遇到慢消费者时的处理，见 SlowPolicy，0=不处理
+    int slow_queue_bytes; // 待发送字节数超过此值即视为慢消费者，0=默认(1MB)
+    int slow_timeout_ms;  // SLOW_POLICY_DISCONNECT：持续超限多久后断开，0=立即
+    int ws_ping_interval_ms;  // WebSocket 保活：连接空闲这么久就发 ping，0=不保活
+    int ws_ping_timeout_ms;   // 这么久未收到消息或 pong 即断开，0=ping 间隔的 2 倍
+    int ip_conn_rate;     // 每个来源 IP 每秒最多新建连接数，超出在 accept 时拒绝，0=不限
+    int ip_max_conns;     // 每个来源 IP 最多同时连接数，0=不限
+    int ip_req_rate;      // 每个来源 IP 每秒最多请求数，超出回复 429，0=不限
+    int cache_max_bytes;  // Server_HttpCache 缓存的响应最多占用的内存，0=默认(16MB)
+    int coalesce_timeout_ms;  // 相同的 GET 请求等待推迟的回复(Server_HttpDefer)最多这么久，超时回复 504，0=不合并
+    const char* coalesce_vary;  // 合并时除方法和 URI 外还须相同的 query 和/或请求头名，逗号分隔，NULL=仅方法和 URI
 } ServerConfig;
 
+typedef enum {
+    IO_BACKEND_DEFAULT = 0,   // 编译选项决定（MG_ENABLE_IO_URING=1 时为 io_uring）
+    IO_BACKEND_EPOLL = 1,     // epoll/poll/select
+    IO_BACKEND_IO_URING = 2   // io_uring，内核不支持时回退到 epoll
+} IoBackend;
+
+typedef enum {
+    SLOW_POLICY_NONE = 0,        // 照常追加到发送缓冲
+    SLOW_POLICY_DROP_OLDEST = 1, // 暂存后续广播，暂存超过 slow_queue_bytes 时丢弃最早的
+    SLOW_POLICY_CONFLATE = 2,    // 同上，且同一合并键只保留最新一条（见 Server_WsBroadcastKeyed）
+    SLOW_POLICY_DISCONNECT = 3   // 超限持续 slow_timeout_ms 后断开
+} SlowPolicy;
+
+typedef struct {
+    unsigned long long ws_dropped_frames;   // 慢消费者被丢弃的广播条数
+    unsigned long long ws_dropped_bytes;    // 慢消费者被丢弃的广播字节数
+    unsigned long long ws_conflated;        // 被同键新消息替换的广播条数
+    unsigned long long ws_slow_disconnects; // 因持续超限被断开的连接数
+    unsigned long long ws_reaped;           // 保活超时被断开的 WebSocket 连接数
+    unsigned long long ip_refused_conns;    // 按来源 IP 限流在 accept 时拒绝的连接数
+    unsigned long long ip_limited_requests; // 按来源 IP 限流回复 429 的请求数
+    unsigned long long cache_hits;          // 从缓存直接回复的请求数（新鲜）
+    unsigned long long cache_stale_hits;    // 以过期副本回复、同时后台刷新的请求数
+    unsigned long long cache_misses;        // 启用缓存后交给 HttpCallback 的 GET 请求数
+    unsigned long long cache_refreshes;     // 后台刷新调用 HttpCallback 的次数
+    unsigned long long cache_evictions;     // 因 cache_max_bytes 不足被丢弃的条目数
+    unsigned long long coalesced_requests;  // 合并到相同请求、未调用 HttpCallback 即收到回复的请求数
+    unsigned long long coalesce_timeouts;   // 等待合并的回复超时、回复 504 的请求数
+} ServerStats;
+
+typedef struct {
+    unsigned long long conn_hits;    // 连接对象从池中复用的次数
+    unsigned long long conn_misses;  // 池为空、需要新分配连接对象的次数
+    unsigned long long buf_hits;     // 收发缓冲从池中复用的次数
+    unsigned long long buf_misses;   // 池为空、需要新分配收发缓冲的次数
+    unsigned int free_conns;         // 池中空闲的连接对象数
+    unsigned int free_bufs;          // 池中空闲的收发缓冲数
+} PoolStats;
+
 typedef enum {
     LOG_LEVEL_NONE = 0,
     LOG_LEVEL_ERROR,
@@ -76,7 +153,25 @@ MG_SERVER_API void __stdcall Server_SetLogLevel(int enabled, LogLevel level);
 MG_SERVER_API void __stdcall Server_SetLogTarget(LogTarget target, const char* filename); // filename 仅在 LOG_TARGET_FILE 时有效
 MG_SERVER_API int __stdcall Server_WsSendToOne(ServerHandle* h, unsigned long long conn_id, const WsMessage* wm);
 MG_SERVER_API int __stdcall Server_WsBroadcast(ServerHandle* h, const WsMessage* wm);
+MG_SERVER_API int __stdcall Server_WsBroadcastKeyed(ServerHandle* h, const WsMessage* wm, const char* key); // key 可为 NULL
+MG_SERVER_API int __stdcall Server_GetStats(ServerHandle* h, ServerStats* stats);
+// 在 HttpCallback 内调用：本次响应可缓存 ttl_ms 毫秒，过期后 stale_ms 内仍以旧副本回复并在后台刷新。
+// vary 为逗号分隔的 query 和/或请求头名，决定哪些请求共用一份缓存，NULL=仅按 URI
+MG_SERVER_API int __stdcall Server_HttpCache(ServerHandle* h, unsigned long long conn_id, int ttl_ms, int stale_ms, const char* vary);
+// 在 HttpCallback 内调用：稍后以 Server_HttpReply 回复本次请求，回调不返回 body
+MG_SERVER_API int __stdcall Server_HttpDefer(ServerHandle* h, unsigned long long conn_id);
 MG_SERVER_API int __stdcall Server_HttpReply(ServerHandle* h, unsigned long long conn_id, const HttpResponse* res);
+MG_SERVER_API int __stdcall Server_GetPoolStats(ServerHandle* h, PoolStats* stats);
+MG_SERVER_API int __stdcall Server_SetUploadRoute(ServerHandle* h, const char* uri_prefix, const char* target_dir,
+                                                  unsigned long long max_size, UploadCallback upload_cb); // max_size 0=不限
+MG_SERVER_API int __stdcall Server_SetBodyCallback(ServerHandle* h, HttpBodyCallback body_cb, const char* uri_prefix); // uri_prefix 可为 NULL
+MG_SERVER_API int __stdcall Server_HttpBeginStream(ServerHandle* h, unsigned long long conn_id, int status_code, const char* headers);
+MG_SERVER_API int __stdcall Server_HttpWriteChunk(ServerHandle* h, unsigned long long conn_id, const char* data, size_t len);
+MG_SERVER_API int __stdcall Server_HttpEndStream(ServerHandle* h, unsigned long long conn_id);
+MG_SERVER_API int __stdcall Server_SetWritableCallback(ServerHandle* h, HttpWritableCallback writable_cb);
+MG_SERVER_API long long __stdcall Server_GetSendQueueBytes(ServerHandle* h, unsigned long long conn_id); // -1=连接不存在
+MG_SERVER_API int __stdcall Server_SetSendQueueCallback(ServerHandle* h, SendQueueCallback sendq_cb);
+MG_SERVER_API int __stdcall Server_SetConnWatermarks(ServerHandle* h, unsigned long long conn_id, unsigned int high, unsigned int low);
 MG_SERVER_API int __stdcall Server_HttpServeFile(ServerHandle* h, unsigned long long conn_id, const char* file_path, const char* extra_headers);
 
 #endif // MGSERVERDLL_H
\ No newline at end of file
@@ -1627,9 +1627,38 @@ static bool isok(uint8_t c) {
   return c == '\n' || c == '\r' || c == '\t' || c >= ' ';
 }
 
+// Length of the leading run of bytes within [lo, hi], other than x and y.
+// Lets the parser skip over tokens and header lines 16 bytes at a time
+static size_t span(const char *s, size_t len, uint8_t lo, uint8_t hi, char x,
+                   char y) {
+  size_t i = 0;
+#if MG_ENABLE_SIMD
+  __m128i vlo = _mm_set1_epi8((char) lo), vw = _mm_set1_epi8((char) (hi - lo));
+  __m128i vx = _mm_set1_epi8(x), vy = _mm_set1_epi8(y);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *) (s + i));
+    __m128i d = _mm_sub_epi8(v, vlo);  // In range if d <= hi - lo, unsigned
+    __m128i in = _mm_cmpeq_epi8(_mm_min_epu8(d, vw), d);
+    __m128i no = _mm_or_si128(_mm_cmpeq_epi8(v, vx), _mm_cmpeq_epi8(v, vy));
+    unsigned m = (unsigned) _mm_movemask_epi8(_mm_andnot_si128(no, in));
+    if (m != 0xffff) {
+      while (m & 1) m >>= 1, i++;
+      return i;
+    }
+  }
+#endif
+  while (i < len && (uint8_t) s[i] >= lo && (uint8_t) s[i] <= hi &&
+         s[i] != x && s[i] != y) {
+    i++;
+  }
+  return i;
+}
+
 int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
   size_t i;
   for (i = 0; i < buf_len; i++) {
+    i += span((const char *) buf + i, buf_len - i, ' ', 255, 0, 0);
+    if (i >= buf_len) break;
     if (!isok(buf[i])) return -1;
     if ((i > 0 && buf[i] == '\n' && buf[i - 1] == '\n') ||
         (i > 3 && buf[i] == '\n' && buf[i - 1] == '\r' && buf[i - 2] == '\n'))
@@ -1637,8 +1666,53 @@ int mg_http_get_request_len(const unsigned char *buf, size_t buf_len) {
   }
   return 0;
 }
+// Headers that mg_http_parse() indexes for O(1) lookups. s_known_tab maps
+// khash() of each name to its index + 1, and must be updated with the list
+static const char *s_known[MG_HTTP_KNOWN] = {
+    "Content-Length", "Transfer-Encoding", "Connection", "Content-Type",
+    "Accept-Encoding", "If-None-Match", "If-Modified-Since", "Range",
+    "Authorization", "Cookie", "Host", "Upgrade", "Sec-WebSocket-Key",
+    "Sec-WebSocket-Protocol", "Sec-WebSocket-Version",
+    "Sec-WebSocket-Extensions", "Origin", "Expect"};
+static const uint8_t s_known_tab[32] = {
+    0, 0, 17, 11, 0, 0, 1, 12, 0, 15, 14, 0, 4, 9, 16, 0, 13, 0, 0, 6, 18, 2, 3,
+    0, 5, 0, 0, 0, 7, 10, 8, 0};
+enum {
+  HDR_CONTENT_LENGTH, HDR_TRANSFER_ENCODING, HDR_CONNECTION, HDR_CONTENT_TYPE,
+  HDR_ACCEPT_ENCODING, HDR_IF_NONE_MATCH, HDR_IF_MODIFIED_SINCE, HDR_RANGE,
+  HDR_AUTHORIZATION, HDR_COOKIE, HDR_HOST, HDR_UPGRADE, HDR_WS_KEY,
+  HDR_WS_PROTOCOL, HDR_WS_VERSION, HDR_WS_EXTENSIONS, HDR_ORIGIN, HDR_EXPECT
+};
+
+static size_t khash(const char *s, size_t n) {
+  const uint8_t *u = (const uint8_t *) s;
+  return (n * 17 + (size_t) (u[0] | 0x20) + (size_t) (u[n - 1] | 0x20) * 21 +
+          (size_t) (u[n / 2] | 0x20)) &
+         31;
+}
+
+// Index of a well-known header name, or -1
+static int known_header(const char *s, size_t n) {
+  int i = n == 0 ? -1 : s_known_tab[khash(s, n)] - 1;
+  if (i < 0 || strlen(s_known[i]) != n) return -1;
+  if (memcmp(s, s_known[i], n) != 0 && mg_ncasecmp(s, s_known[i], n) != 0) {
+    return -1;
+  }
+  return i;
+}
+
+// Value of a well-known header, without looking at names
+static struct mg_str *known_value(struct mg_http_message *hm, int id) {
+  if (!hm->indexed) return mg_http_get_header(hm, s_known[id]);
+  return hm->known[id] == 0 ? NULL : &hm->headers[hm->known[id] - 1].value;
+}
+
 struct mg_str *mg_http_get_header(struct mg_http_message *h, const char *name) {
   size_t i, n = strlen(name), max = sizeof(h->headers) / sizeof(h->headers[0]);
+  int id;
+  if (h->indexed && (id = known_header(name, n)) >= 0) {
+    return h->known[id] == 0 ? NULL : &h->headers[h->known[id] - 1].value;
+  }
   for (i = 0; i < max && h->headers[i].name.len > 0; i++) {
     struct mg_str *k = &h->headers[i].name, *v = &h->headers[i].value;
     if (n == k->len && mg_ncasecmp(k->buf, name, n) == 0) return v;
@@ -1663,10 +1737,23 @@ static size_t clen(const char *s, const char *end) {
   return 0;
 }
 
+// Length of a run of printable ASCII or valid UTF-8, up to the `stop` char
+static size_t toklen(const char *s, const char *end, char stop) {
+  const char *p = s;
+  size_t n;
+  while (p < end) {
+    p += span(p, (size_t) (end - p), '!', '~', stop, stop);  // ASCII in bulk
+    if (p >= end || *p == stop || (n = clen(p, end)) == 0) break;
+    p += n;
+  }
+  return (size_t) (p - s);
+}
+
 // Skip until the newline. Return advanced `s`, or NULL on error
 static const char *skiptorn(const char *s, const char *end, struct mg_str *v) {
+  size_t n = span(s, (size_t) (end - s), 0, 255, '\n', '\r');  // To newline
   v->buf = (char *) s;
-  while (s < end && s[0] != '\n' && s[0] != '\r') s++, v->len++;  // To newline
+  s += n, v->len += n;
   if (s >= end || (s[0] == '\r' && s[1] != '\n')) return NULL;    // Stray \r
   if (s < end && s[0] == '\r') s++;                               // Skip \r
   if (s >= end || *s++ != '\n') return NULL;                      // Skip \n
@@ -1674,14 +1761,17 @@ static const char *skiptorn(const char *s, const char *end, struct mg_str *v) {
 }
 
 static bool mg_http_parse_headers(const char *s, const char *end,
-                                  struct mg_http_header *h, size_t max_hdrs) {
-  size_t i, n;
+                                  struct mg_http_header *h, size_t max_hdrs,
+                                  unsigned short *known) {
+  size_t i;
+  int id;
   for (i = 0; i < max_hdrs; i++) {
     struct mg_str k = {NULL, 0}, v = {NULL, 0};
     if (s >= end) return false;
     if (s[0] == '\n' || (s[0] == '\r' && s[1] == '\n')) break;
     k.buf = (char *) s;
-    while (s < end && s[0] != ':' && (n = clen(s, end)) > 0) s += n, k.len += n;
+    k.len = toklen(s, end, ':');
+    s += k.len;
     if (k.len == 0) return false;                     // Empty name
     if (s >= end || clen(s, end) == 0) return false;  // Invalid UTF-8
     if (*s++ != ':') return false;  // Invalid, not followed by :
@@ -1693,6 +1783,8 @@ static bool mg_http_parse_headers(const char *s, const char *end,
     }
     // MG_INFO(("--HH [%.*s] [%.*s]", (int) k.len, k.buf, (int) v.len, v.buf));
     h[i].name = k, h[i].value = v;  // Success. Assign values
+    id = known_header(k.buf, k.len);
+    if (id >= 0 && known[id] == 0) known[id] = (unsigned short) (i + 1);
   }
   return true;
 }
@@ -1701,7 +1793,6 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
   int is_response, req_len = mg_http_get_request_len((unsigned char *) s, len);
   const char *end = s == NULL ? NULL : s + req_len, *qs;  // Cannot add to NULL
   const struct mg_str *cl;
-  size_t n;
   bool version_prefix_valid;
 
   memset(hm, 0, sizeof(*hm));
@@ -1714,10 +1805,12 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
 
   // Parse request line
   hm->method.buf = (char *) s;
-  while (s < end && (n = clen(s, end)) > 0) s += n, hm->method.len += n;
+  hm->method.len = toklen(s, end, '\0');
+  s += hm->method.len;
   while (s < end && s[0] == ' ') s++;  // Skip spaces
   hm->uri.buf = (char *) s;
-  while (s < end && (n = clen(s, end)) > 0) s += n, hm->uri.len += n;
+  hm->uri.len = toklen(s, end, '\0');
+  s += hm->uri.len;
   while (s < end && s[0] == ' ') s++;  // Skip spaces
   is_response = hm->method.len > 5 &&
                 (mg_ncasecmp(hm->method.buf, "HTTP/", 5) == 0);
@@ -1745,9 +1838,11 @@ int mg_http_parse(const char *s, size_t len, struct mg_http_message *hm) {
   if (hm->method.len == 0 || hm->uri.len == 0) return -1;
 
   if (!mg_http_parse_headers(s, end, hm->headers,
-                             sizeof(hm->headers) / sizeof(hm->headers[0])))
+                             sizeof(hm->headers) / sizeof(hm->headers[0]),
+                             hm->known))
     return -1;  // error when parsing
-  if ((cl = mg_http_get_header(hm, "Content-Length")) != NULL) {
+  hm->indexed = true;
+  if ((cl = known_value(hm, HDR_CONTENT_LENGTH)) != NULL) {
     if (mg_to_size_t(*cl, &hm->body.len) == false) return -1;
     hm->message.len = (size_t) req_len + hm->body.len;
   }
@@ -1810,7 +1905,7 @@ void mg_http_write_chunk(struct mg_connection *c, const char *buf, size_t len) {
 }
 
 // clang-format off
-static const char *mg_http_status_code_str(int status_code) {
+const char *mg_http_status_code_str(int status_code) {
   switch (status_code) {
     case 100: return "Continue";
     case 101: return "Switching Protocols";
@@ -1898,6 +1993,16 @@ void mg_http_reply(struct mg_connection *c, int code, const char *headers,
   c->is_resp = 0;
 }
 
+void mg_http_reply_ref(struct mg_connection *c, int code, const char *headers,
+                       const void *body, size_t len, void (*fn)(void *),
+                       void *arg) {
+  mg_printf(c, "HTTP/1.1 %d %s\r\n%sContent-Length: %lu\r\n\r\n", code,
+            mg_http_status_code_str(code), headers == NULL ? "" : headers,
+            (unsigned long) len);
+  mg_send_ref(c, body, len, fn, arg);
+  c->is_resp = 0;
+}
+
 static void http_cb(struct mg_connection *, int, void *);
 static void restore_http_cb(struct mg_connection *c) {
   mg_fs_close((struct mg_fd *) c->pfn_data);
@@ -2026,7 +2131,7 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
 
   if (path != NULL) {
     // If a browser sends us "Accept-Encoding: gzip", try to open .gz first
-    struct mg_str *ae = mg_http_get_header(hm, "Accept-Encoding");
+    struct mg_str *ae = known_value(hm, HDR_ACCEPT_ENCODING);
     if (ae != NULL) {
       char *ae_ = mg_mprintf("%.*s", ae->len, ae->buf);
       if (ae_ != NULL && strstr(ae_, "gzip") != NULL) {
@@ -2052,7 +2157,7 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
     mg_fs_close(fd);
     // NOTE: mg_http_etag() call should go first!
   } else if (mg_http_etag(etag, sizeof(etag), size, mtime) != NULL &&
-             (inm = mg_http_get_header(hm, "If-None-Match")) != NULL &&
+             (inm = known_value(hm, HDR_IF_NONE_MATCH)) != NULL &&
              mg_strcasecmp(*inm, mg_str(etag)) == 0) {
     mg_fs_close(fd);
     mg_http_reply(c, 304, opts->extra_headers, "");
@@ -2062,7 +2167,7 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
     size_t r1 = 0, r2 = 0, cl = size;
 
     // Handle Range header
-    struct mg_str *rh = mg_http_get_header(hm, "Range");
+    struct mg_str *rh = known_value(hm, HDR_RANGE);
     range[0] = '\0';
     if (rh != NULL && (n = getrange(rh, &r1, &r2)) > 0) {
       // If range is specified like "400-", set second limit to content len
@@ -2093,6 +2198,18 @@ void mg_http_serve_file(struct mg_connection *c, struct mg_http_message *hm,
     if (mg_strcasecmp(hm->method, mg_str("HEAD")) == 0) {
       c->is_resp = 0;
       mg_fs_close(fd);
+    } else if (cl <= MG_HTTP_INLINE_FILE) {
+      // Small file: read it now, so that the response is complete, further
+      // pipelined requests are answered in the same pass, and all of them
+      // leave in one write
+      size_t ofs = c->send.len, n = 0, k = 1;
+      if (mg_iobuf_add(&c->send, ofs, NULL, cl) == cl) {
+        while (n < cl && k > 0) n += (k = fs->rd(fd->fd, c->send.buf + ofs + n, cl - n));
+      }
+      c->send.len = ofs + n;
+      if (n < cl) c->is_draining = 1;  // Short read, Content-Length is wrong
+      c->is_resp = 0;
+      mg_fs_close(fd);
     } else {
       // Track to-be-sent content length at the end of c->data, aligned
       size_t *clp = (size_t *) &c->data[(sizeof(c->data) - sizeof(size_t)) /
@@ -2340,7 +2457,7 @@ size_t mg_url_encode(const char *s, size_t sl, char *buf, size_t len) {
 
 void mg_http_creds(struct mg_http_message *hm, char *user, size_t userlen,
                    char *pass, size_t passlen) {
-  struct mg_str *v = mg_http_get_header(hm, "Authorization");
+  struct mg_str *v = known_value(hm, HDR_AUTHORIZATION);
   user[0] = pass[0] = '\0';
   if (v != NULL && v->len > 6 && memcmp(v->buf, "Basic ", 6) == 0) {
     char buf[256];
@@ -2352,7 +2469,7 @@ void mg_http_creds(struct mg_http_message *hm, char *user, size_t userlen,
     }
   } else if (v != NULL && v->len > 7 && memcmp(v->buf, "Bearer ", 7) == 0) {
     mg_snprintf(pass, passlen, "%.*s", (int) v->len - 7, v->buf + 7);
-  } else if ((v = mg_http_get_header(hm, "Cookie")) != NULL) {
+  } else if ((v = known_value(hm, HDR_COOKIE)) != NULL) {
     struct mg_str t = mg_http_get_header_var(*v, mg_str_n("access_token", 12));
     if (t.len > 0) mg_snprintf(pass, passlen, "%.*s", (int) t.len, t.buf);
   } else {
@@ -2452,6 +2569,39 @@ static int skip_chunk(const char *buf, int len, int *pl, int *dl) {
   return i + 2 + n + 2;
 }
 
+// Streaming mode: pass the body buffered after the headers at ofs to the user
+// in MG_EV_HTTP_CHUNK events and drop it from c->recv. Return 1 when the body
+// is complete, 0 to wait for more data, -1 on error
+static int http_stream(struct mg_connection *c, struct mg_http_message *hm,
+                       size_t ofs, bool is_chunked) {
+  if (is_chunked) {
+    int pl, dl, cl;
+    for (;;) {
+      char *s = (char *) c->recv.buf + ofs;
+      if ((cl = skip_chunk(s, (int) (c->recv.len - ofs), &pl, &dl)) <= 0) {
+        return cl;
+      }
+      if (dl > 0) {
+        hm->chunk = mg_str_n(s + pl, (size_t) dl);
+        mg_call(c, MG_EV_HTTP_CHUNK, hm);
+        c->rx_body += (size_t) dl;
+      }
+      mg_iobuf_del(&c->recv, ofs, (size_t) cl);
+      if (dl == 0) return 1;  // Zero-length chunk ends the body
+    }
+  } else {
+    size_t got = c->recv.len - ofs, left = hm->body.len - c->rx_body;
+    if (got > left) got = left;
+    if (got > 0) {
+      hm->chunk = mg_str_n((char *) c->recv.buf + ofs, got);
+      mg_call(c, MG_EV_HTTP_CHUNK, hm);
+      mg_iobuf_del(&c->recv, ofs, got);
+      c->rx_body += got, left -= got;
+    }
+    return left == 0;
+  }
+}
+
 static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_READ || ev == MG_EV_CLOSE ||
       (ev == MG_EV_POLL && c->is_accepted && !c->is_draining &&
@@ -2474,25 +2624,29 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
         return;
       }
       if (n == 0) break;                 // Request is not buffered yet
-      mg_call(c, MG_EV_HTTP_HDRS, &hm);  // Got all HTTP headers
-      if (c->recv.len != old_len) {
-        // User manipulated received data. Wash our hands
-        MG_DEBUG(("%lu detaching HTTP handler", c->id));
-        c->pfn = NULL;
-        return;
+      if (!c->is_http_hdrs) {  // Headers are parsed again on every read
+        c->is_http_hdrs = 1;
+        mg_call(c, MG_EV_HTTP_HDRS, &hm);  // Got all HTTP headers
+        if (c->recv.len != old_len) {
+          // User manipulated received data. Wash our hands
+          MG_DEBUG(("%lu detaching HTTP handler", c->id));
+          c->pfn = NULL;
+          return;
+        }
       }
-      if (ev == MG_EV_CLOSE) {           // If client did not set Content-Length
-        hm.message.len = c->recv.len - ofs;  // and closes now, deliver MSG
+      // If client did not set Content-Length and closes now, deliver MSG
+      if (ev == MG_EV_CLOSE && !c->is_http_stream) {
+        hm.message.len = c->recv.len - ofs;
         hm.body.len = hm.message.len - (size_t) (hm.body.buf - hm.message.buf);
       }
-      if ((te = mg_http_get_header(&hm, "Transfer-Encoding")) != NULL) {
+      if ((te = known_value(&hm, HDR_TRANSFER_ENCODING)) != NULL) {
         if (mg_strcasecmp(*te, mg_str("chunked")) == 0) {
           is_chunked = true;
         } else {
           mg_error(c, "Invalid Transfer-Encoding");  // See #2460
           return;
         }
-      } else if (mg_http_get_header(&hm, "Content-length") == NULL) {
+      } else if (known_value(&hm, HDR_CONTENT_LENGTH) == NULL) {
         // #2593: HTTP packets must contain either Transfer-Encoding or
         // Content-length
         bool is_response = mg_ncasecmp(hm.method.buf, "HTTP/", 5) == 0;
@@ -2516,7 +2670,18 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
         }
       }
 
-      if (is_chunked) {
+      if (c->is_http_stream && !is_chunked && hm.body.len == (size_t) ~0) {
+        c->is_http_stream = 0;  // Body ends at close, buffer it as before
+      }
+
+      if (c->is_http_stream) {
+        int rc = http_stream(c, &hm, ofs + (size_t) n, is_chunked);
+        if (rc < 0) mg_error(c, "Invalid chunk");
+        if (rc <= 0) break;
+        hm.body.len = 0, hm.chunk.len = 0, hm.message.len = (size_t) n;
+        ofs += (size_t) n;
+        c->rx_body = 0;
+      } else if (is_chunked) {
         // For chunked data, strip off prefixes and suffixes from chunks
         // and relocate them right after the headers, then report a message
         char *s = (char *) c->recv.buf + ofs + n;
@@ -2546,8 +2711,9 @@ static void http_cb(struct mg_connection *c, int ev, void *ev_data) {
 
       if (c->is_accepted) c->is_resp = 1;  // Start generating response
       mg_call(c, MG_EV_HTTP_MSG, &hm);     // User handler can clear is_resp
+      c->is_http_stream = 0, c->is_http_hdrs = 0;
       if (c->is_accepted && !c->is_resp) {
-        struct mg_str *cc = mg_http_get_header(&hm, "Connection");
+        struct mg_str *cc = known_value(&hm, HDR_CONNECTION);
         if (cc != NULL && mg_strcasecmp(*cc, mg_str("close")) == 0) {
           c->is_draining = 1;  // honor "Connection: close"
           break;
@@ -2613,23 +2779,59 @@ static size_t roundup(size_t size, size_t align) {
   return align == 0 ? size : (size + align - 1) / align * align;
 }
 
+// Size for holding need bytes: grow by the growth policy, and give memory
+// back only when much less than the current size is needed
+static size_t fitsize(const struct mg_iobuf *io, size_t need) {
+  int growth = io->growth == 0 ? MG_IOBUF_GROWTH : io->growth;
+  if (growth > 0 && need > io->size) {
+    size_t min = io->size + io->size / 100 * (size_t) growth;
+    if (need < min) need = min;
+  } else if (growth > 0 && need > io->size / 4) {
+    return io->size;
+  }
+  return roundup(need, io->align);
+}
+
+// Move data back to the start of the allocation, reclaiming the consumed head
+static void compact(struct mg_iobuf *io) {
+  size_t n = io->head;
+  if (n == 0) return;
+  io->buf -= n, io->size += n, io->head = 0;
+  if (io->len == 0) return;
+  memmove(io->buf, io->buf + n, io->len);
+  if (io->scrub)
+    mg_bzero(io->buf + (io->len > n ? io->len : n), io->len > n ? n : io->len);
+}
+
 int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   int ok = 1;
   new_size = roundup(new_size, io->align);
+  compact(io);
   if (new_size == 0) {
-    mg_bzero(io->buf, io->size);
+    if (io->scrub) mg_bzero(io->buf, io->size);
     free(io->buf);
     io->buf = NULL;
     io->len = io->size = 0;
   } else if (new_size != io->size) {
+#if MG_IOBUF_REALLOC
+    void *p;
+    if (new_size < io->len && io->scrub) {
+      mg_bzero(io->buf + new_size, io->len - new_size);
+    }
+    p = realloc(io->buf, new_size);
+#else
     // NOTE(lsm): do not use realloc here. Use calloc/free only, to ease the
     // porting to some obscure platforms like FreeRTOS
     void *p = calloc(1, new_size);
     if (p != NULL) {
       size_t len = new_size < io->len ? new_size : io->len;
       if (len > 0 && io->buf != NULL) memmove(p, io->buf, len);
-      mg_bzero(io->buf, io->size);
+      if (io->scrub) mg_bzero(io->buf, io->size);
       free(io->buf);
+    }
+#endif
+    if (p != NULL) {
+      if (io->len > new_size) io->len = new_size;
       io->buf = (unsigned char *) p;
       io->size = new_size;
     } else {
@@ -2640,18 +2842,37 @@ int mg_iobuf_resize(struct mg_iobuf *io, size_t new_size) {
   return ok;
 }
 
+// Make room for need bytes, growing by the growth policy but, if possible,
+// not past limit. Zero limit means no limit
+int mg_iobuf_grow(struct mg_iobuf *io, size_t need, size_t limit) {
+  size_t new_size;
+  if (need <= io->size) return 1;
+  compact(io);
+  if (need <= io->size) return 1;
+  new_size = fitsize(io, need);
+  if (limit > 0 && new_size > limit) new_size = need > limit ? need : limit;
+  return mg_iobuf_resize(io, new_size);
+}
+
 int mg_iobuf_init(struct mg_iobuf *io, size_t size, size_t align) {
   io->buf = NULL;
   io->align = align;
   io->size = io->len = 0;
+  io->growth = 0;
+  io->head = 0;
+  io->scrub = false;
   return mg_iobuf_resize(io, size);
 }
 
 size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf,
                     size_t len) {
-  size_t new_size = roundup(io->len + len, io->align);
-  mg_iobuf_resize(io, new_size);      // Attempt to resize
-  if (new_size != io->size) len = 0;  // Resize failure, append nothing
+  size_t new_size;
+  if (io->len + len > io->size) compact(io);
+  new_size = fitsize(io, io->len + len);
+  // With a consumed head, the size is not a multiple of align, and resizing
+  // to it would round up. Resize only if needed, and judge by what fits
+  if (new_size != io->size) mg_iobuf_resize(io, new_size);
+  if (io->len + len > io->size) len = 0;  // Resize failure, append nothing
   if (ofs < io->len) memmove(io->buf + ofs + len, io->buf + ofs, io->len - ofs);
   if (buf != NULL) memmove(io->buf + ofs, buf, len);
   if (ofs > io->len) io->len += ofs - io->len;
@@ -2662,8 +2883,16 @@ size_t mg_iobuf_add(struct mg_iobuf *io, size_t ofs, const void *buf,
 size_t mg_iobuf_del(struct mg_iobuf *io, size_t ofs, size_t len) {
   if (ofs > io->len) ofs = io->len;
   if (ofs + len > io->len) len = io->len - ofs;
+  if (ofs == 0 && io->buf) {
+    // Consume from the front by skipping it. Compact later, when room is
+    // needed, or rewind for free once everything is consumed
+    if (io->scrub) mg_bzero(io->buf, len);
+    io->buf += len, io->size -= len, io->head += len, io->len -= len;
+    if (io->len == 0) io->buf -= io->head, io->size += io->head, io->head = 0;
+    return len;
+  }
   if (io->buf) memmove(io->buf + ofs, io->buf + ofs + len, io->len - ofs - len);
-  if (io->buf) mg_bzero(io->buf + io->len - len, len);
+  if (io->buf && io->scrub) mg_bzero(io->buf + io->len - len, len);
   io->len -= len;
   return len;
 }
@@ -3889,7 +4118,9 @@ struct mg_connection *mg_mqtt_listen(struct mg_mgr *mgr, const char *url,
 
 size_t mg_vprintf(struct mg_connection *c, const char *fmt, va_list *ap) {
   size_t old = c->send.len;
+  if (c->send.buf == NULL) mg_pool_iobuf(c->mgr, &c->send, 0);
   mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
+  mg_conn_activate(c);
   return c->send.len - old;
 }
 
@@ -3902,6 +4133,56 @@ size_t mg_printf(struct mg_connection *c, const char *fmt, ...) {
   return len;
 }
 
+bool mg_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                 void (*fn)(void *), void *arg) {
+  struct mg_sendref r;
+  bool ok;
+  if (!MG_ENABLE_SOCKET || c->is_udp || len < MG_SEND_REF_MIN) {
+    ok = mg_send(c, buf, len);  // Copying short data is cheaper
+    if (fn != NULL) fn(arg);
+    return ok;
+  }
+  r.ofs = c->send.len, r.buf = (const char *) buf, r.len = len;
+  r.fn = fn, r.arg = arg;
+  ok = mg_iobuf_add(&c->refs, c->refs.len, &r, sizeof(r)) > 0;
+  if (!ok && fn != NULL) fn(arg);
+  mg_conn_activate(c);
+  return ok;
+}
+
+size_t mg_send_queued(const struct mg_connection *c) {
+  const struct mg_sendref *r = (const struct mg_sendref *) c->refs.buf;
+  size_t i, n = c->send.len, nr = c->refs.len / sizeof(*r);
+  for (i = 0; i < nr; i++) n += r[i].len;
+  return n;
+}
+
+// Remove len sent bytes from the head of the output, which is c->send
+// with the referenced data queued in between
+void mg_send_del(struct mg_connection *c, size_t len) {
+  while (len > 0) {
+    struct mg_sendref *r = (struct mg_sendref *) c->refs.buf;
+    size_t i, n, nr = c->refs.len / sizeof(*r);
+    if (nr == 0 || r->ofs > 0) {
+      n = nr == 0 ? c->send.len : r->ofs;
+      if (n > len) n = len;
+      if (n == 0) break;
+      mg_iobuf_del(&c->send, 0, n);
+      for (i = 0; i < nr; i++) r[i].ofs -= n;
+    } else {
+      n = r->len < len ? r->len : len;
+      r->buf += n, r->len -= n;
+      if (r->len == 0) {
+        void (*fn)(void *) = r->fn;
+        void *arg = r->arg;
+        mg_iobuf_del(&c->refs, 0, sizeof(*r));
+        if (fn != NULL) fn(arg);  // May queue more data
+      }
+    }
+    len -= n;
+  }
+}
+
 static bool mg_atonl(struct mg_str str, struct mg_addr *addr) {
   uint32_t localhost = mg_htonl(0x7f000001);
   if (mg_strcasecmp(str, mg_str("localhost")) != 0) return false;
@@ -4004,12 +4285,97 @@ bool mg_aton(struct mg_str str, struct mg_addr *addr) {
          mg_aton6(str, addr);
 }
 
+void mg_conn_activate(struct mg_connection *c) {
+#if MG_ENABLE_EPOLL_READY
+  if (c->is_active == 0) {
+    c->is_active = 1;
+    c->anext = c->mgr->active;
+    c->mgr->active = c;
+  }
+#else
+  (void) c;
+#endif
+}
+
+// Give an empty IO buffer a free one of the smallest pooled size >= need
+void mg_pool_iobuf(struct mg_mgr *mgr, struct mg_iobuf *io, size_t need) {
+#if MG_ENABLE_POOL
+  struct mg_pool *p = &mgr->pool;
+  size_t i = 0, size = MG_IO_SIZE;
+  while (i < MG_POOL_CLASSES && size < need) i++, size <<= 1;
+  if (io->buf != NULL || i >= MG_POOL_CLASSES) return;
+  if (p->bufs[i] == NULL) {
+    p->buf_misses++;
+  } else {
+    void **b = (void **) p->bufs[i];
+    p->bufs[i] = *b, *b = NULL, p->nbufs[i]--, p->buf_hits++;
+    io->buf = (unsigned char *) b, io->size = size, io->len = 0;
+  }
+#else
+  (void) mgr, (void) io, (void) need;
+#endif
+}
+
+// Keep an IO buffer of a pooled size for reuse, free it otherwise
+static void pool_put_iobuf(struct mg_mgr *mgr, struct mg_iobuf *io) {
+#if MG_ENABLE_POOL
+  struct mg_pool *p = &mgr->pool;
+  size_t i = 0, size = MG_IO_SIZE;
+  mg_iobuf_del(io, 0, io->len);  // Rewind to the start of the allocation
+  while (i < MG_POOL_CLASSES && size < io->size) i++, size <<= 1;
+  if (io->buf != NULL && i < MG_POOL_CLASSES && size == io->size &&
+      (p->nbufs[i] + 1) * size <= MG_POOL_CLASS_BYTES) {
+    if (io->scrub) mg_bzero(io->buf, io->size);
+    *(void **) io->buf = p->bufs[i], p->bufs[i] = io->buf, p->nbufs[i]++;
+    io->buf = NULL, io->size = io->len = 0;
+  }
+#else
+  (void) mgr;
+#endif
+  mg_iobuf_free(io);
+}
+
+#if MG_ENABLE_POOL
+static void pool_free(struct mg_mgr *mgr) {
+  struct mg_pool *p = &mgr->pool;
+  size_t i;
+  while (p->conns != NULL) {
+    struct mg_connection *c = p->conns;
+    p->conns = c->next;
+    free(c);
+  }
+  for (i = 0; i < MG_POOL_CLASSES; i++) {
+    while (p->bufs[i] != NULL) {
+      void *b = p->bufs[i];
+      p->bufs[i] = *(void **) b;
+      free(b);
+    }
+    p->nbufs[i] = 0;
+  }
+  p->nconns = 0;
+}
+#endif
+
 struct mg_connection *mg_alloc_conn(struct mg_mgr *mgr) {
-  struct mg_connection *c =
-      (struct mg_connection *) calloc(1, sizeof(*c) + mgr->extraconnsize);
+  struct mg_connection *c = NULL;
+#if MG_ENABLE_POOL
+  if ((c = mgr->pool.conns) != NULL) {
+    mgr->pool.conns = c->next, mgr->pool.nconns--, mgr->pool.conn_hits++;
+    c->next = NULL;  // The rest was zeroed by mg_close_conn()
+  } else {
+    mgr->pool.conn_misses++;
+  }
+#endif
+  if (c == NULL) {
+    c = (struct mg_connection *) calloc(1, sizeof(*c) + mgr->extraconnsize);
+  }
   if (c != NULL) {
     c->mgr = mgr;
     c->send.align = c->recv.align = c->rtls.align = MG_IO_SIZE;
+    c->refs.align = 4 * sizeof(struct mg_sendref);
+    c->send.growth = c->recv.growth = c->rtls.growth = mgr->iobuf_growth;
+    c->send.scrub = c->recv.scrub = mgr->scrub;
+    c->rtls.scrub = true;  // TLS records are always scrubbed
     c->id = ++mgr->nextid;
     MG_PROF_INIT(c);
   }
@@ -4029,9 +4395,23 @@ void mg_close_conn(struct mg_connection *c) {
   MG_PROF_FREE(c);
 
   mg_tls_free(c);
-  mg_iobuf_free(&c->recv);
-  mg_iobuf_free(&c->send);
-  mg_iobuf_free(&c->rtls);
+  while (c->refs.len > 0) {  // Release data that was not sent
+    struct mg_sendref r = *(struct mg_sendref *) c->refs.buf;
+    mg_iobuf_del(&c->refs, 0, sizeof(r));
+    if (r.fn != NULL) r.fn(r.arg);
+  }
+  mg_iobuf_free(&c->refs);
+  pool_put_iobuf(c->mgr, &c->recv);
+  pool_put_iobuf(c->mgr, &c->send);
+  pool_put_iobuf(c->mgr, &c->rtls);
+#if MG_ENABLE_POOL
+  if (c->mgr->pool.nconns < MG_POOL_CONNS) {
+    struct mg_mgr *mgr = c->mgr;
+    mg_bzero((unsigned char *) c, sizeof(*c) + mgr->extraconnsize);
+    c->next = mgr->pool.conns, mgr->pool.conns = c, mgr->pool.nconns++;
+    return;
+  }
+#endif
   mg_bzero((unsigned char *) c, sizeof(*c));
   free(c);
 }
@@ -4051,6 +4431,7 @@ struct mg_connection *mg_connect(struct mg_mgr *mgr, const char *url,
     c->is_client = true;
     c->fn_data = fn_data;
     MG_DEBUG(("%lu %ld %s", c->id, c->fd, url));
+    mg_conn_activate(c);
     mg_call(c, MG_EV_OPEN, (void *) url);
     mg_resolve(c, url);
   }
@@ -4073,6 +4454,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fn = fn;
     c->fn_data = fn_data;
+    mg_conn_activate(c);
     mg_call(c, MG_EV_OPEN, NULL);
     if (mg_url_is_ssl(url)) c->is_tls = 1;  // Accepted connection must
     MG_DEBUG(("%lu %ld %s", c->id, c->fd, url));
@@ -4088,22 +4470,41 @@ struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
     c->fn = fn;
     c->fn_data = fn_data;
     MG_EPOLL_ADD(c);
+    mg_conn_activate(c);
     mg_call(c, MG_EV_OPEN, NULL);
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
   }
   return c;
 }
 
+// Start a caller-owned timer, e.g. one embedded in per-connection state.
+// mg_mgr_free() only unlinks it, so mg_timer_del() stays safe afterwards.
+// The timer must be zeroed before first use. Starting it again, also from
+// its own callback, reschedules it
+void mg_timer_start(struct mg_mgr *mgr, struct mg_timer *t,
+                    uint64_t milliseconds, unsigned flags,
+                    void (*fn)(void *), void *arg) {
+  mg_timer_wheel_unlink(&mgr->timers, t);
+  t->period_ms = milliseconds, t->expire = 0, t->flags = flags;
+  t->fn = fn, t->arg = arg;
+  if (mgr->timers.count == 0) mgr->timers.now = mg_millis();  // Was idle
+  mg_timer_wheel_add(&mgr->timers, t);
+}
+
 struct mg_timer *mg_timer_add(struct mg_mgr *mgr, uint64_t milliseconds,
                               unsigned flags, void (*fn)(void *), void *arg) {
   struct mg_timer *t = (struct mg_timer *) calloc(1, sizeof(*t));
   if (t != NULL) {
     flags |= MG_TIMER_AUTODELETE;  // We have calloc-ed it, so autodelete
-    mg_timer_init(&mgr->timers, t, milliseconds, flags, fn, arg);
+    mg_timer_start(mgr, t, milliseconds, flags, fn, arg);
   }
   return t;
 }
 
+void mg_timer_del(struct mg_mgr *mgr, struct mg_timer *t) {
+  if (t != NULL) mg_timer_wheel_del(&mgr->timers, t);
+}
+
 long mg_io_recv(struct mg_connection *c, void *buf, size_t len) {
   if (c->rtls.len == 0) return MG_IO_WAIT;
   if (len > c->rtls.len) len = c->rtls.len;
@@ -4114,15 +4515,19 @@ long mg_io_recv(struct mg_connection *c, void *buf, size_t len) {
 
 void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_connection *c;
-  struct mg_timer *tmp, *t = mgr->timers;
-  while (t != NULL) tmp = t->next, free(t), t = tmp;
-  mgr->timers = NULL;  // Important. Next call to poll won't touch timers
-  for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
+  mg_timer_wheel_free(&mgr->timers);  // Next call to poll won't touch timers
+  for (c = mgr->conns; c != NULL; c = c->next) {
+    c->is_closing = 1;
+    mg_conn_activate(c);
+  }
   mg_mgr_poll(mgr, 0);
 #if MG_ENABLE_FREERTOS_TCP
   FreeRTOS_DeleteSocketSet(mgr->ss);
 #endif
   MG_DEBUG(("All connections closed"));
+#if MG_ENABLE_IO_URING
+  mg_io_uring_free(mgr);
+#endif
 #if MG_ENABLE_EPOLL
   if (mgr->epoll_fd >= 0) close(mgr->epoll_fd), mgr->epoll_fd = -1;
 #endif
@@ -4130,6 +4535,9 @@ void mg_mgr_free(struct mg_mgr *mgr) {
 #if MG_ENABLE_TCPIP
   if (mgr->ifp) mg_tcpip_free(mgr->ifp);
 #endif
+#if MG_ENABLE_POOL
+  pool_free(mgr);
+#endif
 }
 
 void mg_mgr_init(struct mg_mgr *mgr) {
@@ -4154,10 +4562,16 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   MG_TCPIP_DRIVER_INIT(mgr);
 #endif
   mgr->pipe = MG_INVALID_SOCKET;
+  mgr->listen_backlog = MG_SOCK_LISTEN_BACKLOG_SIZE;
+  mgr->accept_batch = MG_SOCK_ACCEPT_BATCH;
+  mg_timer_wheel_init(&mgr->timers, mg_millis());
   mgr->dnstimeout = 3000;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
   mg_tls_ctx_init(mgr);
+#if MG_ENABLE_IO_URING
+  mg_io_uring_init(mgr);
+#endif
 }
 
 #ifdef MG_ENABLE_LINES
@@ -5368,7 +5782,7 @@ static bool can_write(struct mg_connection *c) {
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   uint64_t now = mg_millis();
-  mg_timer_poll(&mgr->timers, now);
+  mg_timer_wheel_poll(&mgr->timers, now);
   if (mgr->ifp == NULL || mgr->ifp->driver == NULL) return;
   mg_tcpip_poll(mgr->ifp, now);
   for (c = mgr->conns; c != NULL; c = tmp) {
@@ -7602,7 +8016,7 @@ size_t mg_queue_printf(struct mg_queue *q, const char *fmt, ...) {
 
 static void mg_pfn_iobuf_private(char ch, void *param, bool expand) {
   struct mg_iobuf *io = (struct mg_iobuf *) param;
-  if (expand && io->len + 2 > io->size) mg_iobuf_resize(io, io->len + 2);
+  if (expand && io->len + 2 > io->size) mg_iobuf_grow(io, io->len + 2, 0);
   if (io->len + 2 <= io->size) {
     io->buf[io->len++] = (uint8_t) ch;
     io->buf[io->len] = 0;
@@ -7620,7 +8034,7 @@ void mg_pfn_iobuf(char ch, void *param) {
 }
 
 size_t mg_vsnprintf(char *buf, size_t len, const char *fmt, va_list *ap) {
-  struct mg_iobuf io = {(uint8_t *) buf, len, 0, 0};
+  struct mg_iobuf io = {(uint8_t *) buf, len, 0, 0, 0, 0, 0};
   size_t n = mg_vxprintf(mg_putchar_iobuf_static, &io, fmt, ap);
   if (n < len) buf[n] = '\0';
   return n;
@@ -7636,7 +8050,7 @@ size_t mg_snprintf(char *buf, size_t len, const char *fmt, ...) {
 }
 
 char *mg_vmprintf(const char *fmt, va_list *ap) {
-  struct mg_iobuf io = {0, 0, 0, 256};
+  struct mg_iobuf io = {0, 0, 0, 256, 0, 0, 0};
   mg_vxprintf(mg_pfn_iobuf, &io, fmt, ap);
   return (char *) io.buf;
 }
@@ -8651,6 +9065,10 @@ struct mg_connection *mg_sntp_connect(struct mg_mgr *mgr, const char *url,
   (((errcode) < 0) && (errno == EPIPE || errno == ECONNRESET))
 #endif
 
+#if MG_ENABLE_ACCEPT4 && !defined(_GNU_SOURCE)
+int accept4(int, struct sockaddr *, socklen_t *, int);  // Hidden by glibc
+#endif
+
 union usa {
   struct sockaddr sa;
   struct sockaddr_in sin;
@@ -8698,6 +9116,41 @@ static void setlocaddr(MG_SOCKET_TYPE fd, struct mg_addr *addr) {
   }
 }
 
+static bool send_pending(const struct mg_connection *c) {
+  return c->send.len > 0 || c->refs.len > 0;
+}
+
+// First contiguous piece of output: c->send bytes, or referenced data
+static size_t send_head(struct mg_connection *c, char **buf) {
+  struct mg_sendref *r = (struct mg_sendref *) c->refs.buf;
+  if (c->refs.len == 0 || r->ofs > 0) {
+    if (buf != NULL) *buf = (char *) c->send.buf;
+    return c->refs.len == 0 ? c->send.len : r->ofs;
+  }
+  if (buf != NULL) *buf = (char *) r->buf;
+  return r->len;
+}
+
+#if MG_ENABLE_SENDMSG
+// Describe the output as up to max segments, in the order they go out
+static size_t send_iov(struct mg_connection *c, struct iovec *iov,
+                       size_t max) {
+  struct mg_sendref *r = (struct mg_sendref *) c->refs.buf;
+  size_t i, k = 0, ofs = 0, nr = c->refs.len / sizeof(*r);
+  for (i = 0; i <= nr && k < max; i++) {
+    size_t end = i < nr ? r[i].ofs : c->send.len;
+    if (end > ofs) {
+      iov[k].iov_base = c->send.buf + ofs, iov[k++].iov_len = end - ofs;
+      ofs = end;
+    }
+    if (i < nr && k < max) {
+      iov[k].iov_base = (void *) r[i].buf, iov[k++].iov_len = r[i].len;
+    }
+  }
+  return k;
+}
+#endif
+
 static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
   if (n == MG_IO_WAIT) {
     // Do nothing
@@ -8705,17 +9158,21 @@ static void iolog(struct mg_connection *c, char *buf, long n, bool r) {
     c->is_closing = 1;  // Termination. Don't call mg_error(): #1529
   } else if (n > 0) {
     if (c->is_hexdumping) {
+      size_t len = (size_t) n;
+      if (!r && c->refs.len > 0 && send_head(c, NULL) < len) {
+        len = send_head(c, NULL);  // Vectored send, dump the first segment
+      }
       MG_INFO(("\n-- %lu %M %s %M %ld", c->id, mg_print_ip_port, &c->loc,
                r ? "<-" : "->", mg_print_ip_port, &c->rem, n));
-      mg_hexdump(buf, (size_t) n);
+      mg_hexdump(buf, len);
     }
     if (r) {
       c->recv.len += (size_t) n;
       mg_call(c, MG_EV_READ, &n);
     } else {
-      mg_iobuf_del(&c->send, 0, (size_t) n);
+      mg_send_del(c, (size_t) n);
       // if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
-      if (c->send.len == 0) {
+      if (!send_pending(c)) {
         MG_EPOLL_MOD(c, 0);
       }
       mg_call(c, MG_EV_WRITE, &n);
@@ -8740,6 +9197,26 @@ long mg_io_send(struct mg_connection *c, const void *buf, size_t len) {
   return n;
 }
 
+#if MG_ENABLE_SENDMSG
+// Send c->send and the referenced data queued in between with one syscall
+static long mg_io_sendv(struct mg_connection *c, size_t *len) {
+  struct iovec iov[MG_IOV_MAX];
+  struct msghdr msg;
+  size_t i;
+  long n;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = send_iov(c, iov, MG_IOV_MAX);
+  for (*len = i = 0; i < (size_t) msg.msg_iovlen; i++) *len += iov[i].iov_len;
+  n = sendmsg(FD(c), &msg, MSG_NONBLOCKING);
+  MG_VERBOSE(("%lu %ld %d", c->id, n, MG_SOCK_ERR(n)));
+  if (MG_SOCK_PENDING(n)) return MG_IO_WAIT;
+  if (MG_SOCK_RESET(n)) return MG_IO_RESET;
+  if (n <= 0) return MG_IO_ERR;
+  return n;
+}
+#endif
+
 bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
   if (c->is_udp) {
     long n = mg_io_send(c, buf, len);
@@ -8748,6 +9225,8 @@ bool mg_send(struct mg_connection *c, const void *buf, size_t len) {
     iolog(c, (char *) buf, n, false);
     return n > 0;
   } else {
+    mg_conn_activate(c);
+    if (c->send.buf == NULL) mg_pool_iobuf(c->mgr, &c->send, len);
     return mg_iobuf_add(&c->send, c->send.len, buf, len);
   }
 }
@@ -8783,6 +9262,23 @@ static void mg_set_non_blocking_mode(MG_SOCKET_TYPE fd) {
 #endif
 }
 
+static void setsockopts(struct mg_connection *c) {
+#if MG_ENABLE_FREERTOS_TCP || MG_ARCH == MG_ARCH_AZURERTOS || \
+    MG_ARCH == MG_ARCH_TIRTOS
+  (void) c;
+#else
+  int on = 1;
+#if !defined(SOL_TCP)
+#define SOL_TCP IPPROTO_TCP
+#endif
+  if (setsockopt(FD(c), SOL_TCP, TCP_NODELAY, (char *) &on, sizeof(on)) != 0)
+    (void) 0;
+  if (setsockopt(FD(c), SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on)) !=
+      0)
+    (void) 0;
+#endif
+}
+
 void mg_multicast_add(struct mg_connection *c, char *ip);
 void mg_multicast_add(struct mg_connection *c, char *ip) {
 #if MG_ENABLE_RL
@@ -8848,7 +9344,7 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
     } else if ((rc = bind(fd, &usa.sa, slen)) != 0) {
       MG_ERROR(("bind: %d", MG_SOCK_ERR(rc)));
     } else if ((type == SOCK_STREAM &&
-                (rc = listen(fd, MG_SOCK_LISTEN_BACKLOG_SIZE)) != 0)) {
+                (rc = listen(fd, c->mgr->listen_backlog)) != 0)) {
       // NOTE(lsm): FreeRTOS uses backlog value as a connection limit
       // In case port was set to 0, get the real port number
       MG_ERROR(("listen: %d", MG_SOCK_ERR(rc)));
@@ -8856,6 +9352,10 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
       setlocaddr(fd, &c->loc);
       mg_set_non_blocking_mode(fd);
       c->fd = S2PTR(fd);
+#if MG_ENABLE_ACCEPT4
+      // Linux accepted sockets inherit these, no need to set them per accept
+      if (type == SOCK_STREAM) setsockopts(c);
+#endif
       MG_EPOLL_ADD(c);
       success = true;
     }
@@ -8864,8 +9364,377 @@ bool mg_open_listener(struct mg_connection *c, const char *url) {
   return success;
 }
 
+#if MG_ENABLE_IO_URING
+// io_uring backend. Each request's user_data is its connection pointer with
+// the operation in the low bits. close_conn() waits until all requests of a
+// connection are cancelled, so a completion never outlives its connection
+enum {
+  MG_UOP_CANCEL,
+  MG_UOP_ACCEPT,
+  MG_UOP_RECV,
+  MG_UOP_POLLIN,
+  MG_UOP_POLLOUT,
+  MG_UOP_SEND
+};
+
+struct mg_uring {
+  int fd;                           // Ring file descriptor
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  unsigned entries;                 // Submission queue size
+  unsigned tail;                    // Our copy of the submission queue tail
+  unsigned queued;                  // Requests not submitted yet
+  struct io_uring_sqe *sqes;        // Submission queue entries
+  struct io_uring_cqe *cqes;        // Completion queue entries
+  void *sq_ring, *cq_ring;          // Mapped rings
+  size_t sq_len, cq_len, sqes_len;  // Sizes of the mappings
+  struct io_uring_buf_ring *br;     // Provided receive buffer ring
+  size_t br_len;                    // Size of the mapped buffer ring
+  char *bufs;                       // Receive buffers
+  unsigned avail;                   // Receive buffers owned by the kernel
+#if MG_ENABLE_SENDMSG
+  struct msghdr msgs[MG_IO_URING_ENTRIES];      // Vectored sends of a poll
+  struct iovec iovs[MG_IO_URING_ENTRIES * 4];  // Their segments
+  size_t nmsgs, niovs;                          // Used so far
+#endif
+};
+
+struct mg_urx {  // Received data not read yet, see c->rxq
+  uint32_t bid;  // Buffer ID
+  uint32_t ofs;  // Offset of unread data within the buffer
+  uint32_t len;  // Unread length
+};
+
+static int uring_enter(struct mg_uring *u, unsigned wait, int ms) {
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+  int n;
+  memset(&arg, 0, sizeof(arg));
+  if (ms >= 0) {
+    ts.tv_sec = ms / 1000, ts.tv_nsec = (long long) (ms % 1000) * 1000000;
+    arg.ts = (uint64_t) (uintptr_t) &ts;
+  }
+  __atomic_store_n(u->sq_tail, u->tail, __ATOMIC_RELEASE);
+  n = (int) syscall(__NR_io_uring_enter, u->fd, u->queued, wait, flags, &arg,
+                    sizeof(arg));
+  if (n >= 0) {
+    u->queued -= (unsigned) n;
+  } else if (errno != ETIME && errno != EINTR) {
+    MG_ERROR(("io_uring_enter errno %d", errno));
+  }
+  return n;
+}
+
+static struct io_uring_sqe *uring_sqe(struct mg_uring *u, void *ptr, int op,
+                                      uint8_t opcode, int fd) {
+  struct io_uring_sqe *sqe;
+  unsigned i;
+  if (u->tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->entries) {
+    uring_enter(u, 0, 0);  // Queue is full, submit what we have
+  }
+  i = u->tail & *u->sq_mask;
+  sqe = &u->sqes[i];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (uint64_t) (uintptr_t) ptr | (uint64_t) op;
+  u->sq_array[i] = i;
+  u->tail++, u->queued++;
+  return sqe;
+}
+
+// Hand receive buffer back to the kernel
+static void uring_buf_put(struct mg_uring *u, uint32_t bid) {
+  unsigned short tail = u->br->tail;
+  struct io_uring_buf *b = &u->br->bufs[tail & (MG_IO_URING_BUFS - 1)];
+  b->addr = (uint64_t) (uintptr_t) &u->bufs[bid * MG_IO_URING_BUF_SIZE];
+  b->len = MG_IO_URING_BUF_SIZE;
+  b->bid = (uint16_t) bid;
+  __atomic_store_n(&u->br->tail, (unsigned short) (tail + 1), __ATOMIC_RELEASE);
+  u->avail++;
+}
+
+static void uring_pollout(struct mg_connection *c) {
+  struct io_uring_sqe *sqe =
+      uring_sqe(c->mgr->uring, c, MG_UOP_POLLOUT, IORING_OP_POLL_ADD, FD(c));
+  sqe->poll32_events = EPOLLOUT;
+  c->is_uwait = 1;
+}
+
+// Arm multishot requests that deliver incoming data or connections
+static void uring_arm(struct mg_connection *c) {
+  struct mg_uring *u = c->mgr->uring;
+  struct io_uring_sqe *sqe;
+  if (c->is_listening && !c->is_udp) {
+    if (c->is_urecv) return;
+    sqe = uring_sqe(u, c, MG_UOP_ACCEPT, IORING_OP_ACCEPT, FD(c));
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    c->is_urecv = 1;
+  } else if (c->is_udp) {
+    if (c->is_upoll) return;  // Datagrams need recvfrom(), poll only
+    sqe = uring_sqe(u, c, MG_UOP_POLLIN, IORING_OP_POLL_ADD, FD(c));
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = EPOLLIN;
+    c->is_upoll = 1;
+  } else if (!c->is_urecv && !c->is_ueof && !c->is_connecting &&
+             (!c->is_unobuf || u->avail > 0)) {
+    sqe = uring_sqe(u, c, MG_UOP_RECV, IORING_OP_RECV, FD(c));
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    c->is_urecv = 1, c->is_unobuf = 0;
+  }
+}
+
+static void uring_send(struct mg_connection *c) {
+  // MSG_DONTWAIT fails the send instead of queueing it, so it completes
+  // during submission and the data is not referenced after that
+  struct mg_uring *u = c->mgr->uring;
+  struct io_uring_sqe *sqe;
+  char *buf;
+  size_t len = send_head(c, &buf);
+#if MG_ENABLE_SENDMSG
+  size_t max = sizeof(u->iovs) / sizeof(u->iovs[0]) - u->niovs;
+  if (max > MG_IOV_MAX) max = MG_IOV_MAX;
+  if (c->refs.len > 0 && u->nmsgs < MG_IO_URING_ENTRIES && max >= 2) {
+    struct msghdr *msg = &u->msgs[u->nmsgs++];
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_iov = &u->iovs[u->niovs];
+    msg->msg_iovlen = send_iov(c, msg->msg_iov, max);
+    u->niovs += (size_t) msg->msg_iovlen;
+    sqe = uring_sqe(u, c, MG_UOP_SEND, IORING_OP_SENDMSG, FD(c));
+    sqe->addr = (uint64_t) (uintptr_t) msg;
+  } else
+#endif
+  {
+    sqe = uring_sqe(u, c, MG_UOP_SEND, IORING_OP_SEND, FD(c));
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = len > UINT_MAX ? UINT_MAX : (unsigned) len;
+  }
+  sqe->msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL;
+  c->is_usend = 1;
+}
+
+// Record completion. No event handlers are called here, so it is safe to
+// process completions of other connections from within close_conn()
+static void uring_complete(struct mg_uring *u, struct io_uring_cqe *cqe) {
+  struct mg_connection *c =
+      (struct mg_connection *) (uintptr_t) (cqe->user_data & ~(uint64_t) 7);
+  int op = (int) (cqe->user_data & 7), res = cqe->res;
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  if (op == MG_UOP_CANCEL) return;
+  if (op == MG_UOP_ACCEPT) {
+    if (!more) c->is_urecv = 0;
+    if (res >= 0 && !mg_iobuf_add(&c->recv, c->recv.len, &res, sizeof(res))) {
+      close(res);
+    } else if (res < 0 && res != -ECANCELED) {
+      MG_ERROR(("%lu accept failed, errno %d", c->id, -res));
+    }
+    c->is_readable = 1;
+  } else if (op == MG_UOP_RECV) {
+    if (!more) c->is_urecv = 0;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      struct mg_urx rx = {cqe->flags >> IORING_CQE_BUFFER_SHIFT, 0, 0};
+      rx.len = res > 0 ? (uint32_t) res : 0;
+      u->avail--;
+      if (res <= 0 || !mg_iobuf_add(&c->rxq, c->rxq.len, &rx, sizeof(rx))) {
+        uring_buf_put(u, rx.bid);
+        if (res > 0) c->is_ueof = 1;  // OOM, we've lost data
+      }
+    }
+    if (res == -ENOBUFS) {
+      c->is_unobuf = 1;  // Re-armed once some buffers are read
+    } else if (res <= 0 && res != -ECANCELED) {
+      c->is_ueof = 1;
+    }
+    if (c->is_full == 0) c->is_readable = 1;
+  } else if (op == MG_UOP_POLLIN) {
+    if (!more) c->is_upoll = 0;
+    if (res > 0) c->is_rdmore = 1;  // Kept until read, see uring_prepare()
+  } else if (op == MG_UOP_POLLOUT) {
+    c->is_uwait = 0;
+    if (res > 0) c->is_writable = 1;
+  } else if (op == MG_UOP_SEND) {
+    c->is_usend = 0, c->is_usdone = 1, c->is_writable = 1;
+    if (res > 0) {
+      c->usent = res;
+    } else if (res == -EAGAIN) {
+      c->usent = MG_IO_WAIT;
+      uring_pollout(c);
+    } else {
+      c->usent = res == -ECONNRESET ? MG_IO_RESET : MG_IO_ERR;
+    }
+  }
+  mg_conn_activate(c);
+}
+
+static void uring_reap(struct mg_uring *u) {
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    uring_complete(u, &u->cqes[head & *u->cq_mask]);
+  }
+  __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Read from the received buffers instead of the socket
+static long uring_recv(struct mg_connection *c, char *buf, size_t len) {
+  struct mg_uring *u = c->mgr->uring;
+  size_t n = 0;
+  while (n < len && c->rxq.len > 0) {
+    struct mg_urx *rx = (struct mg_urx *) c->rxq.buf;
+    size_t k = len - n < rx->len ? len - n : rx->len;
+    memcpy(buf + n, &u->bufs[rx->bid * MG_IO_URING_BUF_SIZE + rx->ofs], k);
+    n += k, rx->ofs += (uint32_t) k, rx->len -= (uint32_t) k;
+    if (rx->len > 0) break;
+    uring_buf_put(u, rx->bid);
+    mg_iobuf_del(&c->rxq, 0, sizeof(*rx));
+  }
+  if (n > 0) return (long) n;
+  return c->is_ueof ? MG_IO_ERR : MG_IO_WAIT;
+}
+
+// Pop the connection accepted by multishot accept
+static MG_SOCKET_TYPE uring_accept(struct mg_connection *lsn, union usa *usa,
+                                   socklen_t *len) {
+  int fd;
+  if (lsn->recv.len < sizeof(fd)) {
+    errno = EAGAIN;
+    return MG_INVALID_SOCKET;
+  }
+  memcpy(&fd, lsn->recv.buf, sizeof(fd));
+  mg_iobuf_del(&lsn->recv, 0, sizeof(fd));
+  memset(usa, 0, sizeof(*usa));
+  getpeername(fd, &usa->sa, len);
+  return fd;
+}
+
+// Cancel requests of a connection that is about to close, wait for that
+static void uring_close(struct mg_connection *c) {
+  struct mg_uring *u = c->mgr->uring;
+  if (c->is_urecv || c->is_upoll || c->is_uwait || c->is_usend) {
+    struct io_uring_sqe *sqe =
+        uring_sqe(u, NULL, MG_UOP_CANCEL, IORING_OP_ASYNC_CANCEL, FD(c));
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    while (c->is_urecv || c->is_upoll || c->is_uwait || c->is_usend) {
+      if (uring_enter(u, 1, 1000) < 0 && errno != ETIME && errno != EINTR) {
+        break;
+      }
+      uring_reap(u);
+    }
+  }
+  while (c->rxq.len > 0) {
+    uring_buf_put(u, ((struct mg_urx *) c->rxq.buf)->bid);
+    mg_iobuf_del(&c->rxq, 0, sizeof(struct mg_urx));
+  }
+  mg_iobuf_free(&c->rxq);
+  if (c->is_listening) {  // Close accepted, but not yet served connections
+    union usa usa;
+    socklen_t n = sizeof(usa);
+    MG_SOCKET_TYPE fd;
+    while ((fd = uring_accept(c, &usa, &n)) != MG_INVALID_SOCKET) close(fd);
+  }
+}
+
+static void uring_release(struct mg_uring *u) {
+  if (u->fd >= 0) close(u->fd);
+  if (u->sqes != NULL) munmap(u->sqes, u->sqes_len);
+  if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+    munmap(u->cq_ring, u->cq_len);
+  }
+  if (u->sq_ring != NULL) munmap(u->sq_ring, u->sq_len);
+  if (u->br != NULL) munmap(u->br, u->br_len);
+  free(u->bufs);
+  free(u);
+}
+
+static void *uring_mmap(size_t len, int fd, off_t ofs) {
+  int flags = fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED | MAP_POPULATE;
+  void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, fd, ofs);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+bool mg_io_uring_init(struct mg_mgr *mgr) {
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  struct mg_uring *u;
+  unsigned i, need = IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+  if (mgr->uring != NULL) return true;
+  if (mgr->conns != NULL) return false;
+  if ((u = (struct mg_uring *) calloc(1, sizeof(*u))) == NULL) return false;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = MG_IO_URING_ENTRIES * 4;  // Room for multishot completions
+  u->fd = (int) syscall(__NR_io_uring_setup, MG_IO_URING_ENTRIES, &p);
+  if (u->fd < 0 || (p.features & need) != need) {
+    MG_ERROR(("io_uring unavailable, errno %d", u->fd < 0 ? errno : 0));
+    uring_release(u);
+    return false;
+  }
+  u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (u->cq_len > u->sq_len) u->sq_len = u->cq_len;
+    u->cq_len = u->sq_len;
+  }
+  u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  u->br_len = MG_IO_URING_BUFS * sizeof(struct io_uring_buf);
+  u->sq_ring = uring_mmap(u->sq_len, u->fd, IORING_OFF_SQ_RING);
+  u->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP
+                   ? u->sq_ring
+                   : uring_mmap(u->cq_len, u->fd, IORING_OFF_CQ_RING);
+  u->sqes = (struct io_uring_sqe *) uring_mmap(u->sqes_len, u->fd,
+                                               IORING_OFF_SQES);
+  u->br = (struct io_uring_buf_ring *) uring_mmap(u->br_len, -1, 0);
+  u->bufs = (char *) malloc((size_t) MG_IO_URING_BUFS * MG_IO_URING_BUF_SIZE);
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+  reg.ring_entries = MG_IO_URING_BUFS;
+  if (u->sq_ring == NULL || u->cq_ring == NULL || u->sqes == NULL ||
+      u->br == NULL || u->bufs == NULL ||
+      syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg,
+              1) != 0) {
+    MG_ERROR(("io_uring setup failed, errno %d", errno));
+    uring_release(u);
+    return false;
+  }
+  u->sq_head = (unsigned *) ((char *) u->sq_ring + p.sq_off.head);
+  u->sq_tail = (unsigned *) ((char *) u->sq_ring + p.sq_off.tail);
+  u->sq_mask = (unsigned *) ((char *) u->sq_ring + p.sq_off.ring_mask);
+  u->sq_flags = (unsigned *) ((char *) u->sq_ring + p.sq_off.flags);
+  u->sq_array = (unsigned *) ((char *) u->sq_ring + p.sq_off.array);
+  u->cq_head = (unsigned *) ((char *) u->cq_ring + p.cq_off.head);
+  u->cq_tail = (unsigned *) ((char *) u->cq_ring + p.cq_off.tail);
+  u->cq_mask = (unsigned *) ((char *) u->cq_ring + p.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring + p.cq_off.cqes);
+  u->entries = p.sq_entries;
+  u->tail = *u->sq_tail;
+  for (i = 0; i < MG_IO_URING_BUFS; i++) uring_buf_put(u, i);
+  mgr->uring = u;
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd), mgr->epoll_fd = -1;
+  MG_DEBUG(("io_uring %d, %u entries", u->fd, u->entries));
+  return true;
+}
+
+void mg_io_uring_free(struct mg_mgr *mgr) {
+  if (mgr->uring == NULL || mgr->conns != NULL) return;
+  uring_release(mgr->uring);
+  mgr->uring = NULL;
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    MG_ERROR(("epoll_create1 errno %d", errno));
+  }
+}
+#endif
+
 static long recv_raw(struct mg_connection *c, void *buf, size_t len) {
   long n = 0;
+#if MG_ENABLE_IO_URING
+  if (c->mgr->uring != NULL && !c->is_udp) {
+    return uring_recv(c, (char *) buf, len);
+  }
+#endif
   if (c->is_udp) {
     union usa usa;
     socklen_t slen = tousa(&c->rem, &usa);
@@ -8883,10 +9752,12 @@ static long recv_raw(struct mg_connection *c, void *buf, size_t len) {
 
 static bool ioalloc(struct mg_connection *c, struct mg_iobuf *io) {
   bool res = false;
+  if (io->buf == NULL) mg_pool_iobuf(c->mgr, io, 0);
   if (io->len >= MG_MAX_RECV_SIZE) {
     mg_error(c, "MG_MAX_RECV_SIZE");
   } else if (io->size <= io->len &&
-             !mg_iobuf_resize(io, io->size + MG_IO_SIZE)) {
+             !mg_iobuf_grow(io, io->size + MG_IO_SIZE,
+                            MG_MAX_RECV_SIZE + MG_IO_SIZE)) {
     mg_error(c, "OOM");
   } else {
     res = true;
@@ -8895,8 +9766,10 @@ static bool ioalloc(struct mg_connection *c, struct mg_iobuf *io) {
 }
 
 // NOTE(lsm): do only one iteration of reads, cause some systems
-// (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data
-static void read_conn(struct mg_connection *c) {
+// (e.g. FreeRTOS stack) return 0 instead of -1/EWOULDBLOCK when no data.
+// Return true if the socket may have more data, see MG_ENABLE_EPOLL_ET
+static bool read_conn(struct mg_connection *c) {
+  bool more = false;
   if (ioalloc(c, &c->recv)) {
     char *buf = (char *) &c->recv.buf[c->recv.len];
     size_t len = c->recv.size - c->recv.len;
@@ -8905,11 +9778,13 @@ static void read_conn(struct mg_connection *c) {
       // Do not read to the raw TLS buffer if it already has enough.
       // This is to prevent overflowing c->rtls if our reads are slow
       long m;
+      more = true;  // Socket not read, so not drained either
       if (c->rtls.len < 16 * 1024 + 40) {  // TLS record, header, MAC, padding
-        if (!ioalloc(c, &c->rtls)) return;
+        if (!ioalloc(c, &c->rtls)) return false;
         n = recv_raw(c, (char *) &c->rtls.buf[c->rtls.len],
                      c->rtls.size - c->rtls.len);
         if (n > 0) c->rtls.len += (size_t) n;
+        more = n > 0;
       }
       // there can still be > 16K from last iteration, always mg_tls_recv()
       m = c->is_tls_hs ? (long) MG_IO_WAIT : mg_tls_recv(c, buf, len);
@@ -8928,27 +9803,49 @@ static void read_conn(struct mg_connection *c) {
       n = m;
     } else {
       n = recv_raw(c, buf, len);
+      more = n > 0;  // Not a short read check: FIN may be queued after data
     }
     MG_DEBUG(("%lu %ld %lu:%lu:%lu %ld err %d", c->id, c->fd, c->send.len,
               c->recv.len, c->rtls.len, n, MG_SOCK_ERR(n)));
     iolog(c, buf, n, true);
   }
+  return more && !c->is_closing;
 }
 
-static void write_conn(struct mg_connection *c) {
-  char *buf = (char *) c->send.buf;
-  size_t len = c->send.len;
-  long n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
+// Return true if the socket accepted data, and may accept more
+static bool write_conn(struct mg_connection *c) {
+  char *buf;
+  size_t len = send_head(c, &buf);
+  long n;
+#if MG_ENABLE_IO_URING
+  if (c->is_usdone) {  // Batched send has completed in mg_iotest()
+    c->is_usdone = 0;
+    n = c->usent;
+  } else
+#endif
+#if MG_ENABLE_SENDMSG
+  if (!c->is_tls && c->refs.len > 0) {
+    n = mg_io_sendv(c, &len);
+  } else
+#endif
+  n = c->is_tls ? mg_tls_send(c, buf, len) : mg_io_send(c, buf, len);
   MG_DEBUG(("%lu %ld snd %ld/%ld rcv %ld/%ld n=%ld err=%d", c->id, c->fd,
             (long) c->send.len, (long) c->send.size, (long) c->recv.len,
             (long) c->recv.size, n, MG_SOCK_ERR(n)));
   iolog(c, buf, n, false);
+  // A short TCP write means the socket buffer is full
+  return n > 0 && !c->is_closing && (c->is_tls || (size_t) n >= len);
 }
 
 static void close_conn(struct mg_connection *c) {
   if (FD(c) != MG_INVALID_SOCKET) {
+#if MG_ENABLE_IO_URING
+    if (c->mgr->uring != NULL) uring_close(c);
+#endif
 #if MG_ENABLE_EPOLL
-    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
+    if (c->mgr->epoll_fd >= 0) {
+      epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
+    }
 #endif
     closesocket(FD(c));
 #if MG_ENABLE_FREERTOS_TCP
@@ -8973,23 +9870,6 @@ static void connect_conn(struct mg_connection *c) {
   }
 }
 
-static void setsockopts(struct mg_connection *c) {
-#if MG_ENABLE_FREERTOS_TCP || MG_ARCH == MG_ARCH_AZURERTOS || \
-    MG_ARCH == MG_ARCH_TIRTOS
-  (void) c;
-#else
-  int on = 1;
-#if !defined(SOL_TCP)
-#define SOL_TCP IPPROTO_TCP
-#endif
-  if (setsockopt(FD(c), SOL_TCP, TCP_NODELAY, (char *) &on, sizeof(on)) != 0)
-    (void) 0;
-  if (setsockopt(FD(c), SOL_SOCKET, SO_KEEPALIVE, (char *) &on, sizeof(on)) !=
-      0)
-    (void) 0;
-#endif
-}
-
 void mg_connect_resolved(struct mg_connection *c) {
   int type = c->is_udp ? SOCK_DGRAM : SOCK_STREAM;
   int proto = type == SOCK_DGRAM ? IPPROTO_UDP : IPPROTO_TCP;
@@ -9034,30 +9914,62 @@ static MG_SOCKET_TYPE raccept(MG_SOCKET_TYPE sock, union usa *usa,
   MG_SOCKET_TYPE fd = MG_INVALID_SOCKET;
   do {
     memset(usa, 0, sizeof(*usa));
+#if MG_ENABLE_ACCEPT4
+    fd = accept4(sock, &usa->sa, len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
     fd = accept(sock, &usa->sa, len);
+#endif
   } while (MG_SOCK_INTR(fd));
   return fd;
 }
 
-static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+// Ask mgr->accept_fn, if set, whether to admit a client before allocating
+// a connection for it
+static bool accept_admit(struct mg_mgr *mgr, union usa *usa, socklen_t len) {
+  struct mg_addr a;
+  if (mgr->accept_fn == NULL) return true;
+  memset(&a, 0, sizeof(a));
+  tomgaddr(usa, &a, len != sizeof(usa->sin));
+  if (mgr->accept_fn(mgr, &a)) return true;
+  MG_VERBOSE(("refused %M", mg_print_ip, &a));
+  return false;
+}
+
+// Accept one connection. Return false when there is nothing more to accept.
+// Failures after the first accept of a batch just mean the queue is drained
+static bool accept_one(struct mg_mgr *mgr, struct mg_connection *lsn,
+                       bool first) {
   struct mg_connection *c = NULL;
   union usa usa;
   socklen_t sa_len = sizeof(usa);
+#if MG_ENABLE_IO_URING
+  MG_SOCKET_TYPE fd = lsn->mgr->uring != NULL
+                          ? uring_accept(lsn, &usa, &sa_len)
+                          : raccept(FD(lsn), &usa, &sa_len);
+#else
   MG_SOCKET_TYPE fd = raccept(FD(lsn), &usa, &sa_len);
+#endif
   if (fd == MG_INVALID_SOCKET) {
 #if MG_ARCH == MG_ARCH_AZURERTOS || defined(__ECOS)
     // AzureRTOS, in non-block socket mode can mark listening socket readable
     // even it is not. See comment for 'select' func implementation in
     // nx_bsd.c That's not an error, just should try later
-    if (errno != EAGAIN)
+    if (errno == EAGAIN) first = false;
+#endif
+#if MG_ENABLE_EPOLL_ET || MG_ENABLE_IO_URING
+    if (MG_SOCK_PENDING(-1)) first = false;  // Queue drained by last batch
 #endif
+    if (first)
       MG_ERROR(("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERR(-1)));
+    return false;
 #if (MG_ARCH != MG_ARCH_WIN32) && !MG_ENABLE_FREERTOS_TCP && \
     (MG_ARCH != MG_ARCH_TIRTOS) && !MG_ENABLE_POLL && !MG_ENABLE_EPOLL
   } else if ((long) fd >= FD_SETSIZE) {
     MG_ERROR(("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
 #endif
+  } else if (!accept_admit(mgr, &usa, sa_len)) {
+    closesocket(fd);
   } else if ((c = mg_alloc_conn(mgr)) == NULL) {
     MG_ERROR(("%lu OOM", lsn->id));
     closesocket(fd);
@@ -9066,8 +9978,10 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
     c->fd = S2PTR(fd);
     MG_EPOLL_ADD(c);
+#if !MG_ENABLE_ACCEPT4
     mg_set_non_blocking_mode(FD(c));
     setsockopts(c);
+#endif
     c->is_accepted = 1;
     c->is_hexdumping = lsn->is_hexdumping;
     c->loc = lsn->loc;
@@ -9077,9 +9991,21 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     c->fn_data = lsn->fn_data;
     MG_DEBUG(("%lu %ld accepted %M -> %M", c->id, c->fd, mg_print_ip_port,
               &c->rem, mg_print_ip_port, &c->loc));
+    mg_conn_activate(c);
     mg_call(c, MG_EV_OPEN, NULL);
     mg_call(c, MG_EV_ACCEPT, NULL);
   }
+  return true;
+}
+
+// Drain the accept queue, up to mgr->accept_batch connections per poll
+// Return true if the whole batch was accepted, and more may be pending
+static bool accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
+  int i, max = mgr->accept_batch > 0 ? mgr->accept_batch : 1;
+  for (i = 0; i < max && !lsn->is_closing; i++) {
+    if (!accept_one(mgr, lsn, i == 0)) return false;
+  }
+  return i == max;
 }
 
 static bool can_read(const struct mg_connection *c) {
@@ -9087,7 +10013,7 @@ static bool can_read(const struct mg_connection *c) {
 }
 
 static bool can_write(const struct mg_connection *c) {
-  return c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0);
+  return c->is_connecting || (send_pending(c) && c->is_tls_hs == 0);
 }
 
 static bool skip_iotest(const struct mg_connection *c) {
@@ -9095,7 +10021,74 @@ static bool skip_iotest(const struct mg_connection *c) {
          (can_read(c) == false && can_write(c) == false);
 }
 
+// Do not sleep past the next timer deadline. Negative ms means "forever"
+static int mg_timer_timeout(struct mg_mgr *mgr, int ms) {
+  uint64_t next = mg_timer_wheel_next(&mgr->timers), now;
+  if (next != (uint64_t) -1) {
+    now = mg_millis();
+    next = next > now ? next - now : 0;
+    if (next > INT_MAX) next = INT_MAX;  // Wheel timers may be weeks away
+    if (ms < 0 || next < (uint64_t) ms) ms = (int) next;
+  }
+  return ms;
+}
+
+#if MG_ENABLE_IO_URING
+// Queue requests the connection needs, return true if it needs no waiting
+static bool uring_prepare(struct mg_connection *c) {
+  bool now = false;
+  c->is_readable = c->is_writable = 0;
+  if (c->is_closing) return true;
+  if (c->is_resolving || FD(c) == MG_INVALID_SOCKET) return false;
+  uring_arm(c);
+  if (c->is_usdone) {
+    c->is_writable = 1, now = true;  // Report the completed send first
+  } else if (can_write(c) && !c->is_uwait && !c->is_usend) {
+    if (c->is_connecting || c->is_tls || c->is_udp) {
+      uring_pollout(c);  // These write to the socket themselves
+    } else {
+      uring_send(c);
+    }
+  }
+  if ((c->rxq.len > 0 || c->is_ueof) && can_read(c)) c->is_readable = 1;
+  if (c->is_rdmore && can_read(c)) c->is_readable = 1, c->is_rdmore = 0;
+  if (c->rtls.len > 0 || mg_tls_pending(c) > 0) c->is_readable = 1;
+  if (c->is_listening && c->recv.len > 0) c->is_readable = 1;
+  if (c->is_draining && !send_pending(c)) now = true;
+  return now || c->is_readable;
+}
+
+// Submit queued requests, including sends, and wait for completions in a
+// single io_uring_enter(). Sends complete during submission, so a poll
+// that sends does not wait
+static void uring_iotest(struct mg_mgr *mgr, int ms) {
+  struct mg_uring *u = mgr->uring;
+  struct mg_connection *c;
+#if MG_ENABLE_SENDMSG
+  u->nmsgs = u->niovs = 0;  // Sends of the last poll have completed
+#endif
+#if MG_ENABLE_EPOLL_READY
+  for (c = mgr->active; c != NULL; c = c->anext) {
+#else
+  for (c = mgr->conns; c != NULL; c = c->next) {
+#endif
+    if (uring_prepare(c)) ms = 0;
+  }
+  if (ms != 0 || u->queued > 0 || (*u->sq_flags & IORING_SQ_CQ_OVERFLOW)) {
+    uring_enter(u, ms == 0 ? 0 : 1, ms);
+  }
+  uring_reap(u);
+}
+#endif
+
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
+  ms = mg_timer_timeout(mgr, ms);
+#if MG_ENABLE_IO_URING
+  if (mgr->uring != NULL) {
+    uring_iotest(mgr, ms);
+    return;
+  }
+#endif
 #if MG_ENABLE_FREERTOS_TCP
   struct mg_connection *c;
   for (c = mgr->conns; c != NULL; c = c->next) {
@@ -9115,6 +10108,50 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
       FreeRTOS_FD_CLR(c->fd, mgr->ss,
                       eSELECT_READ | eSELECT_EXCEPT | eSELECT_WRITE);
   }
+#elif MG_ENABLE_EPOLL_READY
+  struct epoll_event evs[MG_EPOLL_MAX_EVENTS];
+  struct mg_connection *c;
+  int i, n;
+  // Only queued connections need their interest set or timeout revisited
+  for (c = mgr->active; c != NULL; c = c->anext) {
+    c->is_readable = c->is_writable = 0;
+    if (c->is_closing || FD(c) == MG_INVALID_SOCKET) {
+      if (c->is_closing) ms = 0;
+      continue;
+    }
+    if (c->rtls.len > 0 || mg_tls_pending(c) > 0) ms = 0, c->is_readable = 1;
+    if (c->is_draining && !send_pending(c)) ms = 0;
+#if MG_ENABLE_EPOLL_ET
+    // Edges are reported once, so remember what is left from the last poll.
+    // Fresh output is written right away, EPOLLOUT is armed only when the
+    // socket would block, see write_drain()
+    if (c->is_rdmore && can_read(c)) ms = 0, c->is_readable = 1;
+    if (c->is_connecting) {
+      MG_EPOLL_MOD(c, 1);
+    } else if (can_write(c) && (c->is_wrmore || !c->is_pollout)) {
+      ms = 0, c->is_writable = 1;
+    }
+#else
+    MG_EPOLL_MOD(c, can_write(c));
+#endif
+  }
+  n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_MAX_EVENTS, ms);
+  for (i = 0; i < n; i++) {
+    c = (struct mg_connection *) evs[i].data.ptr;
+    mg_conn_activate(c);
+    if (evs[i].events & EPOLLERR) {
+      mg_error(c, "socket error");
+    } else {
+      bool rd = evs[i].events & (EPOLLIN | EPOLLHUP);
+      bool wr = evs[i].events & EPOLLOUT;
+      if (can_read(c) && rd) c->is_readable = 1;
+      if (can_write(c) && wr) c->is_writable = 1;
+#if MG_ENABLE_EPOLL_ET
+      if (rd) c->is_rdmore = 1;  // Keep the edge if reads are blocked now
+#endif
+    }
+  }
+  (void) skip_iotest;
 #elif MG_ENABLE_EPOLL
   size_t max = 1;
   for (struct mg_connection *c = mgr->conns; c != NULL; c = c->next) {
@@ -9314,43 +10351,119 @@ bool mg_wakeup(struct mg_mgr *mgr, unsigned long conn_id, const void *buf,
   return false;
 }
 
+// Should connection stay queued for the next poll, MG_ENABLE_EPOLL_READY
+static bool is_busy(struct mg_connection *c) {
+#if MG_ENABLE_IO_URING
+  if (c->rxq.len > 0 || c->is_ueof || c->is_unobuf || c->is_usdone) {
+    return true;
+  }
+#endif
+  return c->is_closing || c->is_draining || c->is_resolving ||
+         c->is_connecting || c->is_resp || c->is_listening || c->is_client ||
+         c->is_udp || send_pending(c) || c->rtls.len > 0 ||
+         c->is_rdmore || c->is_wrmore || mg_tls_pending(c) > 0;
+}
+
+#if MG_ENABLE_EPOLL_ET
+// Read until the socket would block, the receive buffer is full, or the
+// per-poll budget is spent. In the latter cases, is_rdmore keeps the
+// connection queued, and other connections get their turn first
+static void read_drain(struct mg_connection *c) {
+  int budget = MG_EPOLL_ET_BUDGET;
+  bool more = true;
+  while (more && budget-- > 0 && can_read(c) && !c->is_closing) {
+    more = read_conn(c);
+  }
+  c->is_rdmore = more ? 1U : 0U;
+}
+
+static void write_drain(struct mg_connection *c) {
+  int budget = MG_EPOLL_ET_BUDGET;
+  bool more = true;
+  while (more && budget-- > 0 && send_pending(c) && !c->is_closing) {
+    more = write_conn(c);
+  }
+  c->is_wrmore = more && send_pending(c) ? 1U : 0U;
+  if (!more && send_pending(c) && !c->is_closing) MG_EPOLL_MOD(c, 1);
+}
+#endif
+
+// A response has just completed: parse pipelined requests buffered behind it
+// now, rather than on a later poll, so their responses join the same write
+static void http_resume(struct mg_connection *c, bool was_resp) {
+  if (was_resp && !c->is_resp && !c->is_closing && c->recv.len > 0) {
+    long n = 0;
+    mg_call(c, MG_EV_READ, &n);
+  }
+}
+
+// Process one connection: deliver MG_EV_POLL, do IO, close if needed.
+// Return true if the connection has been closed and freed
+static bool poll_conn(struct mg_mgr *mgr, struct mg_connection *c,
+                      uint64_t *now) {
+  bool is_resp = c->is_resp;
+  mg_call(c, MG_EV_POLL, now);
+  http_resume(c, is_resp);
+  is_resp = c->is_resp;
+  MG_VERBOSE(("%lu %c%c %c%c%c%c%c %lu %lu", c->id,
+              c->is_readable ? 'r' : '-', c->is_writable ? 'w' : '-',
+              c->is_tls ? 'T' : 't', c->is_connecting ? 'C' : 'c',
+              c->is_tls_hs ? 'H' : 'h', c->is_resolving ? 'R' : 'r',
+              c->is_closing ? 'C' : 'c', mg_tls_pending(c), c->rtls.len));
+  if (c->is_resolving || c->is_closing) {
+    // Do nothing
+  } else if (c->is_listening && c->is_udp == 0) {
+#if MG_ENABLE_EPOLL_ET
+    if (c->is_readable) c->is_rdmore = accept_conn(mgr, c) ? 1U : 0U;
+#else
+    if (c->is_readable) accept_conn(mgr, c);
+#endif
+  } else if (c->is_connecting) {
+    if (c->is_readable || c->is_writable) connect_conn(c);
+    //} else if (c->is_tls_hs) {
+    //  if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
+  } else {
+#if MG_ENABLE_EPOLL_ET
+    if (c->is_readable) read_drain(c);
+    if (c->is_writable) write_drain(c);
+#else
+    if (c->is_readable) read_conn(c);
+    if (c->is_writable) write_conn(c);
+#endif
+  }
+
+  http_resume(c, is_resp);  // E.g. a static file finished on MG_EV_WRITE
+  if (c->is_draining && !send_pending(c)) c->is_closing = 1;
+  if (c->is_closing == 0) return false;
+  close_conn(c);
+  return true;
+}
+
 void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   struct mg_connection *c, *tmp;
   uint64_t now;
 
   mg_iotest(mgr, ms);
   now = mg_millis();
-  mg_timer_poll(&mgr->timers, now);
-
+  mg_timer_wheel_poll(&mgr->timers, now);
+
+#if MG_ENABLE_EPOLL_READY
+  // Walk the queue only. Connections stay marked active while we process
+  // them, and get re-queued if they still have work to do
+  c = mgr->active, mgr->active = NULL;
+  for (; c != NULL; c = tmp) {
+    tmp = c->anext;
+    if (poll_conn(mgr, c, &now)) continue;
+    c->is_active = 0, c->is_readable = c->is_writable = 0;
+    if (is_busy(c)) mg_conn_activate(c);
+  }
+#else
   for (c = mgr->conns; c != NULL; c = tmp) {
-    bool is_resp = c->is_resp;
     tmp = c->next;
-    mg_call(c, MG_EV_POLL, &now);
-    if (is_resp && !c->is_resp) {
-      long n = 0;
-      mg_call(c, MG_EV_READ, &n);
-    }
-    MG_VERBOSE(("%lu %c%c %c%c%c%c%c %lu %lu", c->id,
-                c->is_readable ? 'r' : '-', c->is_writable ? 'w' : '-',
-                c->is_tls ? 'T' : 't', c->is_connecting ? 'C' : 'c',
-                c->is_tls_hs ? 'H' : 'h', c->is_resolving ? 'R' : 'r',
-                c->is_closing ? 'C' : 'c', mg_tls_pending(c), c->rtls.len));
-    if (c->is_resolving || c->is_closing) {
-      // Do nothing
-    } else if (c->is_listening && c->is_udp == 0) {
-      if (c->is_readable) accept_conn(mgr, c);
-    } else if (c->is_connecting) {
-      if (c->is_readable || c->is_writable) connect_conn(c);
-      //} else if (c->is_tls_hs) {
-      //  if ((c->is_readable || c->is_writable)) mg_tls_handshake(c);
-    } else {
-      if (c->is_readable) read_conn(c);
-      if (c->is_writable) write_conn(c);
-    }
-
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
-    if (c->is_closing) close_conn(c);
+    poll_conn(mgr, c, &now);
   }
+  (void) is_busy;
+#endif
 }
 #endif
 
@@ -9371,7 +10484,7 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
 
 #if MG_ENABLE_SSI
 static char *mg_ssi(const char *path, const char *root, int depth) {
-  struct mg_iobuf b = {NULL, 0, 0, MG_IO_SIZE};
+  struct mg_iobuf b = {NULL, 0, 0, MG_IO_SIZE, 0, 0, 0};
   FILE *fp = fopen(path, "rb");
   if (fp != NULL) {
     char buf[MG_SSI_BUFSIZ], arg[sizeof(buf)];
@@ -9691,6 +10804,239 @@ void mg_timer_poll(struct mg_timer **head, uint64_t now_ms) {
   }
 }
 
+#define MG_TIMER_WHEEL_MASK ((uint64_t) MG_TIMER_WHEEL_SLOTS - 1)
+#define MG_TIMER_WHEEL_SPAN (MG_TIMER_WHEEL_BITS * MG_TIMER_WHEEL_LEVELS)
+
+static unsigned mg_timer_msb(uint64_t x) {
+#if defined(__GNUC__)
+  return 63U - (unsigned) __builtin_clzll(x);
+#else
+  unsigned n = 0;
+  while (x >>= 1) n++;
+  return n;
+#endif
+}
+
+static unsigned mg_timer_lsb(uint64_t x) {
+#if defined(__GNUC__)
+  return (unsigned) __builtin_ctzll(x);
+#else
+  unsigned n = 0;
+  while ((x & 1) == 0) x >>= 1, n++;
+  return n;
+#endif
+}
+
+static void mg_timer_link(struct mg_timer **head, struct mg_timer *t,
+                          unsigned slot) {
+  t->next = *head;
+  if (t->next != NULL) t->next->pprev = &t->next;
+  t->pprev = head;
+  t->slot = slot;
+  *head = t;
+}
+
+static void mg_timer_unlink(struct mg_timer_wheel *w, struct mg_timer *t) {
+  *t->pprev = t->next;
+  if (t->next != NULL) t->next->pprev = t->pprev;
+  if (t->slot < MG_TIMER_SLOT_DUE) {
+    unsigned level = t->slot / MG_TIMER_WHEEL_SLOTS;
+    unsigned idx = t->slot % MG_TIMER_WHEEL_SLOTS;
+    if (w->slots[level][idx] == NULL) w->occupied[level] &= ~(1ULL << idx);
+  }
+  t->next = NULL, t->pprev = NULL, t->slot = MG_TIMER_SLOT_NONE;
+}
+
+// Place timer into the level where its expiration time first differs from
+// the current wheel time. When the wheel reaches the start of that slot,
+// the timer gets cascaded down to a finer level, so expiration is exact
+static void mg_timer_place(struct mg_timer_wheel *w, struct mg_timer *t) {
+  if (t->expire <= w->now) {
+    mg_timer_link(&w->due, t, MG_TIMER_SLOT_DUE);
+  } else {
+    unsigned level = mg_timer_msb(t->expire ^ w->now) / MG_TIMER_WHEEL_BITS;
+    if (level >= MG_TIMER_WHEEL_LEVELS) {
+      mg_timer_link(&w->far, t, MG_TIMER_SLOT_FAR);
+    } else {
+      unsigned shift = level * MG_TIMER_WHEEL_BITS;
+      unsigned idx = (unsigned) ((t->expire >> shift) & MG_TIMER_WHEEL_MASK);
+      mg_timer_link(&w->slots[level][idx], t,
+                    level * MG_TIMER_WHEEL_SLOTS + idx);
+      w->occupied[level] |= 1ULL << idx;
+    }
+  }
+}
+
+// Move all timers from the given list back into the wheel
+static void mg_timer_cascade(struct mg_timer_wheel *w, struct mg_timer **head) {
+  struct mg_timer *t;
+  while ((t = *head) != NULL) {
+    mg_timer_unlink(w, t);
+    mg_timer_place(w, t);
+  }
+}
+
+void mg_timer_wheel_init(struct mg_timer_wheel *w, uint64_t now) {
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+void mg_timer_wheel_add(struct mg_timer_wheel *w, struct mg_timer *t) {
+  if (t->expire == 0) {
+    bool now = (t->flags & MG_TIMER_RUN_NOW) && !(t->flags & MG_TIMER_CALLED);
+    t->expire = now ? w->now : w->now + t->period_ms;
+  }
+  mg_timer_place(w, t);
+  w->count++;
+}
+
+// Take a scheduled timer out of the wheel, keeping it allocated
+void mg_timer_wheel_unlink(struct mg_timer_wheel *w, struct mg_timer *t) {
+  if (t->pprev != NULL) {
+    mg_timer_unlink(w, t);
+    w->count--;
+  }
+}
+
+void mg_timer_wheel_del(struct mg_timer_wheel *w, struct mg_timer *t) {
+  if (t == w->running) {
+    // Poll releases it when the callback returns. The callback may have
+    // started it again, so it can be linked as well
+    w->running_deleted = true;
+    mg_timer_wheel_unlink(w, t);
+  } else if (t->pprev != NULL) {
+    mg_timer_wheel_unlink(w, t);
+    if (t->flags & MG_TIMER_AUTODELETE) free(t);
+  }
+}
+
+// Earliest time when a wheel slot must be fired or cascaded down
+static uint64_t mg_timer_next_slot(struct mg_timer_wheel *w) {
+  uint64_t next = (uint64_t) -1;
+  unsigned level;
+  for (level = 0; level < MG_TIMER_WHEEL_LEVELS; level++) {
+    unsigned shift = level * MG_TIMER_WHEEL_BITS;
+    unsigned up = shift + MG_TIMER_WHEEL_BITS;
+    unsigned cur = (unsigned) ((w->now >> shift) & MG_TIMER_WHEEL_MASK);
+    uint64_t bits = cur + 1 >= MG_TIMER_WHEEL_SLOTS
+                        ? 0
+                        : w->occupied[level] & (~0ULL << (cur + 1));
+    if (bits != 0) {
+      uint64_t t = ((w->now >> up) << up) |
+                   ((uint64_t) mg_timer_lsb(bits) << shift);
+      if (t < next) next = t;
+    }
+  }
+  if (w->far != NULL) {
+    uint64_t t = ((w->now >> MG_TIMER_WHEEL_SPAN) + 1) << MG_TIMER_WHEEL_SPAN;
+    if (t < next) next = t;
+  }
+  return next;
+}
+
+// Returns the earliest time when mg_timer_wheel_poll() has work to do, or
+// (uint64_t) -1 if there are no timers
+uint64_t mg_timer_wheel_next(struct mg_timer_wheel *w) {
+  return w->due != NULL ? w->now : mg_timer_next_slot(w);
+}
+
+// Clock went backwards, e.g. 32-bit GetTickCount() wrapped. Keep the time
+// left for every timer, and rebuild the wheel relative to the new time
+static void mg_timer_rebase(struct mg_timer_wheel *w, uint64_t now) {
+  struct mg_timer *list = NULL, *t;
+  unsigned i, j;
+  for (i = 0; i < MG_TIMER_WHEEL_LEVELS; i++) {
+    for (j = 0; j < MG_TIMER_WHEEL_SLOTS; j++) {
+      while ((t = w->slots[i][j]) != NULL) {
+        mg_timer_unlink(w, t);
+        t->expire = now + (t->expire - w->now);
+        mg_timer_link(&list, t, MG_TIMER_SLOT_DUE);
+      }
+    }
+  }
+  while ((t = w->far) != NULL) {
+    mg_timer_unlink(w, t);
+    t->expire = now + (t->expire - w->now);
+    mg_timer_link(&list, t, MG_TIMER_SLOT_DUE);
+  }
+  w->now = now;
+  mg_timer_cascade(w, &list);
+}
+
+// Call expired timers. Repeating timers are collected in the `again` list,
+// and rescheduled when the poll is done, thus called at most once per poll
+static void mg_timer_fire(struct mg_timer_wheel *w, struct mg_timer **again) {
+  struct mg_timer *list = w->due, *t;
+  w->due = NULL;  // Detach, so that timers added by callbacks do not fire now
+  if (list != NULL) list->pprev = &list;
+  while ((t = list) != NULL) {
+    mg_timer_unlink(w, t);
+    if ((t->flags & MG_TIMER_REPEAT) || !(t->flags & MG_TIMER_CALLED)) {
+      w->running = t, w->running_deleted = false;
+      t->fn(t->arg);
+      w->running = NULL;
+    }
+    if (t->pprev != NULL) {
+      // Started again by its callback, which scheduled and counted it anew
+      w->count--, w->running_deleted = false;
+      continue;
+    }
+    t->flags |= MG_TIMER_CALLED;
+    if (w->running_deleted || !(t->flags & MG_TIMER_REPEAT)) {
+      w->count--;
+      if (t->flags & MG_TIMER_AUTODELETE) free(t);
+    } else {
+      mg_timer_link(again, t, MG_TIMER_SLOT_DUE);
+    }
+    w->running_deleted = false;
+  }
+}
+
+void mg_timer_wheel_poll(struct mg_timer_wheel *w, uint64_t now) {
+  struct mg_timer *again = NULL, *t;
+  uint64_t next;
+  if (now < w->now) mg_timer_rebase(w, now);
+  mg_timer_fire(w, &again);
+  // Jump straight to the next non-empty slot, never step over idle ticks
+  while ((next = mg_timer_next_slot(w)) <= now) {
+    unsigned level;
+    w->now = next;
+    if ((next & ((1ULL << MG_TIMER_WHEEL_SPAN) - 1)) == 0) {
+      mg_timer_cascade(w, &w->far);
+    }
+    // Cascade from the coarsest level whose slot starts now, down to level 0
+    for (level = MG_TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+      unsigned shift = level * MG_TIMER_WHEEL_BITS;
+      if ((next & ((1ULL << shift) - 1)) == 0) {
+        unsigned idx = (unsigned) ((next >> shift) & MG_TIMER_WHEEL_MASK);
+        mg_timer_cascade(w, &w->slots[level][idx]);
+      }
+    }
+    mg_timer_cascade(w, &w->slots[0][next & MG_TIMER_WHEEL_MASK]);
+    mg_timer_fire(w, &again);
+  }
+  w->now = now;
+  for (t = again; t != NULL; t = t->next) {
+    // Same as mg_timer_expired(): if we're late for more than a period,
+    // schedule relative to now, otherwise keep the original cadence
+    uint64_t prd = t->period_ms;
+    t->expire = (now - t->expire) > prd ? now + prd : t->expire + prd;
+  }
+  mg_timer_cascade(w, &again);
+}
+
+void mg_timer_wheel_free(struct mg_timer_wheel *w) {
+  struct mg_timer *t;
+  unsigned i, j;
+  for (i = 0; i < MG_TIMER_WHEEL_LEVELS; i++) {
+    for (j = 0; j < MG_TIMER_WHEEL_SLOTS; j++) {
+      while ((t = w->slots[i][j]) != NULL) mg_timer_wheel_del(w, t);
+    }
+  }
+  while ((t = w->due) != NULL) mg_timer_wheel_del(w, t);
+  while ((t = w->far) != NULL) mg_timer_wheel_del(w, t);
+}
+
 #ifdef MG_ENABLE_LINES
 #line 1 "src/tls_aes128.c"
 #endif
@@ -12441,6 +13787,7 @@ void mg_tls_init(struct mg_connection *c, const struct mg_tls_opts *opts) {
 
   tls->skip_verification = opts->skip_verification;
   // tls->send.align = MG_IO_SIZE;
+  tls->send.scrub = true;
 
   c->tls = tls;
   c->is_tls = c->is_tls_hs = 1;
@@ -12509,6 +13856,7 @@ void mg_tls_free(struct mg_connection *c) {
     mg_iobuf_free(&tls->send);
     free((void *) tls->cert_der.buf);
     free((void *) tls->ca_der.buf);
+    mg_bzero((unsigned char *) tls, sizeof(*tls));  // Wipe session keys
   }
   free(c->tls);
   c->tls = NULL;
@@ -19915,6 +21263,246 @@ struct ws_msg {
   size_t data_len;
 };
 
+#if MG_ENABLE_WS_DEFLATE
+#include <zlib.h>
+
+// permessage-deflate state of a connection, c->wsd
+struct ws_deflate {
+  z_stream tx, rx;          // Compressor of sent, inflater of received data
+  struct mg_iobuf tbuf;     // Last compressed message
+  struct mg_iobuf rbuf;     // Last inflated message
+  size_t threshold;         // Send shorter messages uncompressed
+  int key;                  // Compression parameters if output is shareable
+  bool tx_reset, rx_reset;  // No context takeover
+};
+
+// permessage-deflate offer or response parameters
+struct ws_ext {
+  bool srv_nct, cli_nct;   // server_ / client_no_context_takeover
+  int srv_bits, cli_bits;  // .._max_window_bits: 0 absent, -1 without value
+};
+
+static struct mg_str ws_trim(struct mg_str s) {
+  while (s.len > 0 && (s.buf[0] == ' ' || s.buf[0] == '\t')) s.buf++, s.len--;
+  while (s.len > 0 && (s.buf[s.len - 1] == ' ' || s.buf[s.len - 1] == '\t'))
+    s.len--;
+  if (s.len >= 2 && s.buf[0] == '"' && s.buf[s.len - 1] == '"')
+    s.buf++, s.len -= 2;
+  return s;
+}
+
+// Window bits parameter: -1 if no value, 0 if invalid. zlib can't do 8
+static int ws_bits(struct mg_str v) {
+  uint8_t n = 0;
+  if (v.len == 0) return -1;
+  return mg_str_to_num(v, 10, &n, sizeof(n)) && n >= 9 && n <= 15 ? n : 0;
+}
+
+// Find the first permessage-deflate entry in an extensions header that
+// has only known, valid parameters
+static bool ws_ext_parse(struct mg_str s, struct ws_ext *e) {
+  struct mg_str offer, name, k, v;
+  while (mg_span(s, &offer, &s, ',')) {
+    bool ok = true;
+    memset(e, 0, sizeof(*e));
+    mg_span(offer, &name, &offer, ';');
+    if (mg_strcasecmp(ws_trim(name), mg_str("permessage-deflate")) != 0) {
+      continue;
+    }
+    while (ok && mg_span(offer, &k, &offer, ';')) {
+      mg_span(k, &k, &v, '=');
+      k = ws_trim(k), v = ws_trim(v);
+      if (mg_strcasecmp(k, mg_str("server_no_context_takeover")) == 0) {
+        e->srv_nct = true;
+      } else if (mg_strcasecmp(k, mg_str("client_no_context_takeover")) == 0) {
+        e->cli_nct = true;
+      } else if (mg_strcasecmp(k, mg_str("server_max_window_bits")) == 0) {
+        ok = (e->srv_bits = ws_bits(v)) > 0;
+      } else if (mg_strcasecmp(k, mg_str("client_max_window_bits")) == 0) {
+        ok = (e->cli_bits = ws_bits(v)) != 0;
+      } else {
+        ok = false;
+      }
+    }
+    if (ok) return true;
+  }
+  return false;
+}
+
+static int ws_cfg_bits(const struct mg_ws_deflate *o) {
+  return o->window_bits <= 0 || o->window_bits > 15 ? 15
+         : o->window_bits < 9                        ? 9
+                                                     : o->window_bits;
+}
+
+static bool ws_deflate_init(struct mg_connection *c, int bits, bool tx_reset,
+                            bool rx_reset) {
+  struct mg_ws_deflate *o = &c->mgr->ws_deflate;
+  struct ws_deflate *d = (struct ws_deflate *) calloc(1, sizeof(*d));
+  int level = o->level > 0 && o->level <= 9 ? o->level : Z_DEFAULT_COMPRESSION;
+  int mem = o->mem_level > 0 && o->mem_level <= 9 ? o->mem_level : 8;
+  if (d == NULL) return false;
+  if (deflateInit2(&d->tx, level, Z_DEFLATED, -bits, mem,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(d);
+    return false;
+  }
+  if (inflateInit2(&d->rx, -15) != Z_OK) {
+    deflateEnd(&d->tx);
+    free(d);
+    return false;
+  }
+  d->tbuf.align = d->rbuf.align = 256;
+  d->threshold = o->threshold;
+  d->tx_reset = tx_reset, d->rx_reset = rx_reset;
+  // Without context takeover, equal parameters give equal output
+  d->key = tx_reset ? (bits << 8) | (mem << 4) | (level & 15) : 0;
+  c->wsd = d;
+  return true;
+}
+
+static void ws_deflate_free(struct mg_connection *c) {
+  struct ws_deflate *d = (struct ws_deflate *) c->wsd;
+  if (d != NULL) {
+    deflateEnd(&d->tx);
+    inflateEnd(&d->rx);
+    mg_iobuf_free(&d->tbuf);
+    mg_iobuf_free(&d->rbuf);
+    free(d);
+    c->wsd = NULL;
+  }
+}
+
+// Accept a client's offer. Fill buf with the response header value
+static void ws_deflate_accept(struct mg_connection *c, struct mg_str *hdr,
+                              char *buf, size_t len) {
+  struct mg_ws_deflate *o = &c->mgr->ws_deflate;
+  struct ws_ext e;
+  int bits = ws_cfg_bits(o), cbits = bits;
+  size_t n;
+  bool tx_reset;
+  if (!o->enabled || hdr == NULL || !ws_ext_parse(*hdr, &e)) return;
+  if (e.srv_bits > 0 && e.srv_bits < bits) bits = e.srv_bits;
+  if (e.cli_bits > 0 && e.cli_bits < cbits) cbits = e.cli_bits;  // RFC 7692
+  tx_reset = o->no_context_takeover || e.srv_nct;
+  if (!ws_deflate_init(c, bits, tx_reset, o->no_context_takeover)) return;
+  n = mg_snprintf(buf, len, "permessage-deflate%s%s",
+                  tx_reset ? "; server_no_context_takeover" : "",
+                  o->no_context_takeover ? "; client_no_context_takeover" : "");
+  if (e.srv_bits > 0) {
+    n += mg_snprintf(buf + n, len - n, "; server_max_window_bits=%d", bits);
+  }
+  if (e.cli_bits != 0 && cbits < 15) {
+    mg_snprintf(buf + n, len - n, "; client_max_window_bits=%d", cbits);
+  }
+}
+
+// Set up compression agreed in a server's 101 response
+static bool ws_deflate_agreed(struct mg_connection *c, struct mg_str *hdr) {
+  struct mg_ws_deflate *o = &c->mgr->ws_deflate;
+  struct ws_ext e;
+  int bits = ws_cfg_bits(o);
+  if (!o->enabled || hdr == NULL) return true;
+  if (!ws_ext_parse(*hdr, &e)) return false;
+  if (e.cli_bits > 0 && e.cli_bits < bits) bits = e.cli_bits;
+  return ws_deflate_init(c, bits, o->no_context_takeover || e.cli_nct,
+                         e.srv_nct);
+}
+
+// Run zlib over the input, appending output to the buffer
+static bool ws_zrun(z_stream *z, bool tx, const void *buf, size_t len,
+                    struct mg_iobuf *io) {
+  z->next_in = (Bytef *) buf;
+  z->avail_in = (uInt) len;
+  for (;;) {
+    int rc;
+    if (!tx && io->len > MG_MAX_RECV_SIZE) return false;  // Inflate bomb
+    if (io->size - io->len < 64 &&
+        !mg_iobuf_grow(io, io->len + len / 2 + MG_IO_SIZE, 0)) {
+      return false;
+    }
+    z->next_out = io->buf + io->len;
+    z->avail_out = (uInt) (io->size - io->len);
+    rc = tx ? deflate(z, Z_SYNC_FLUSH) : inflate(z, Z_SYNC_FLUSH);
+    io->len = (size_t) (z->next_out - io->buf);
+    if (rc == Z_STREAM_END && !tx) return inflateReset(z) == Z_OK;
+    if (rc != Z_OK && rc != Z_BUF_ERROR) return false;
+    if (z->avail_out > 0) return z->avail_in == 0;
+  }
+}
+
+// Compress a message into d->tbuf, less the trailing 00 00 ff ff
+static bool ws_zip(struct ws_deflate *d, const void *buf, size_t len) {
+  bool ok;
+  d->tbuf.len = 0;
+  ok = ws_zrun(&d->tx, true, buf, len, &d->tbuf) && d->tbuf.len >= 4;
+  if (ok) d->tbuf.len -= 4;
+  // Resetting is safe either way: the peer keeps more history than we use
+  if (d->tx_reset || !ok) deflateReset(&d->tx);
+  return ok;
+}
+
+// Inflate a message, or a part of it when streaming
+static bool ws_unzip(struct ws_deflate *d, struct mg_str *data, bool final) {
+  static const uint8_t tail[] = {0, 0, 0xff, 0xff};
+  bool ok;
+  d->rbuf.len = 0;
+  ok = ws_zrun(&d->rx, false, data->buf, data->len, &d->rbuf) &&
+       (!final || ws_zrun(&d->rx, false, tail, sizeof(tail), &d->rbuf));
+  if ((final && d->rx_reset) || !ok) inflateReset(&d->rx);
+  *data = mg_str_n((char *) d->rbuf.buf, d->rbuf.len);
+  return ok;
+}
+
+// Whether this connection compresses this message itself
+static bool ws_zippable(struct mg_connection *c, size_t len, int op) {
+  struct ws_deflate *d = (struct ws_deflate *) c->wsd;
+  return d != NULL && (op == WEBSOCKET_OP_TEXT || op == WEBSOCKET_OP_BINARY) &&
+         len > 0 && len >= d->threshold;
+}
+
+int mg_ws_deflate_key(struct mg_connection *c, size_t len) {
+  struct ws_deflate *d = (struct ws_deflate *) c->wsd;
+  return ws_zippable(c, len, WEBSOCKET_OP_BINARY) ? d->key : 0;
+}
+
+struct mg_str mg_ws_deflate(struct mg_connection *c, const void *buf,
+                            size_t len) {
+  struct ws_deflate *d = (struct ws_deflate *) c->wsd;
+  if (d == NULL || !ws_zip(d, buf, len)) return mg_str_n(NULL, 0);
+  return mg_str_n((char *) d->tbuf.buf, d->tbuf.len);
+}
+#else
+int mg_ws_deflate_key(struct mg_connection *c, size_t len) {
+  (void) c, (void) len;
+  return 0;
+}
+
+struct mg_str mg_ws_deflate(struct mg_connection *c, const void *buf,
+                            size_t len) {
+  (void) c, (void) buf, (void) len;
+  return mg_str_n(NULL, 0);
+}
+#endif
+
+// Deliver a data message or a part of it, inflating it if needed
+static void ws_deliver(struct mg_connection *c, struct mg_ws_message *m) {
+#if MG_ENABLE_WS_DEFLATE
+  if ((m->flags & WEBSOCKET_OP_DEFLATED) && c->wsd != NULL) {
+    if (!ws_unzip((struct ws_deflate *) c->wsd, &m->data, m->final)) {
+      mg_error(c, "WS inflate");
+      return;
+    }
+    m->flags &= (uint8_t) ~WEBSOCKET_OP_DEFLATED;
+  }
+#endif
+  if (m->flags & WEBSOCKET_OP_DEFLATED) {
+    mg_error(c, "WS RSV1");  // Compressed, but no extension was negotiated
+    return;
+  }
+  mg_call(c, MG_EV_WS_MSG, m);
+}
+
 size_t mg_ws_vprintf(struct mg_connection *c, int op, const char *fmt,
                      va_list *ap) {
   size_t len = c->send.len;
@@ -19933,8 +21521,8 @@ size_t mg_ws_printf(struct mg_connection *c, int op, const char *fmt, ...) {
 }
 
 static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
-                         const struct mg_str *wsproto, const char *fmt,
-                         va_list *ap) {
+                         const struct mg_str *wsproto, const char *ext,
+                         const char *fmt, va_list *ap) {
   const char *magic = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
   unsigned char sha[20], b64_sha[30];
 
@@ -19950,6 +21538,7 @@ static void ws_handshake(struct mg_connection *c, const struct mg_str *wskey,
              "Connection: Upgrade\r\n"
              "Sec-WebSocket-Accept: %s\r\n",
              b64_sha);
+  if (*ext != '\0') mg_printf(c, "Sec-WebSocket-Extensions: %s\r\n", ext);
   if (fmt != NULL) mg_vxprintf(mg_pfn_iobuf, &c->send, fmt, ap);
   if (wsproto != NULL) {
     mg_printf(c, "Sec-WebSocket-Protocol: %.*s\r\n", (int) wsproto->len,
@@ -19963,8 +21552,61 @@ static uint32_t be32(const uint8_t *p) {
          (((uint32_t) p[1]) << 16) | (((uint32_t) p[0]) << 24);
 }
 
-static size_t ws_process(uint8_t *buf, size_t len, struct ws_msg *msg) {
-  size_t i, n = 0, mask_len = 0;
+#ifdef MG_SIMD_AVX2
+__attribute__((target("avx2"))) static size_t ws_xor_avx2(uint8_t *p,
+                                                          size_t len,
+                                                          uint32_t k) {
+  __m256i km = _mm256_set1_epi32((int) k);
+  size_t i;
+  for (i = 0; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) (p + i));
+    _mm256_storeu_si256((__m256i *) (p + i), _mm256_xor_si256(v, km));
+  }
+  return i;
+}
+#endif
+
+// XOR data with a WebSocket mask: 32 or 16 bytes at a time with SIMD, then
+// 8, then byte by byte. All steps are multiples of 4, so one pre-rotated
+// mask word serves them all
+static void ws_xor(uint8_t *p, size_t len, const uint8_t *mask) {
+  uint8_t m[4], r[8];
+  uint32_t k;
+  uint64_t k64;
+  size_t i = 0, j;
+  memcpy(m, mask, sizeof(m));
+  while (i < len && ((uintptr_t) (p + i) & 7) != 0) p[i] ^= m[i & 3], i++;
+  for (j = 0; j < sizeof(r); j++) r[j] = m[(i + j) & 3];
+  memcpy(&k, r, sizeof(k));
+  memcpy(&k64, r, sizeof(k64));
+#ifdef MG_SIMD_AVX2
+  {
+    static int avx2 = -1;
+    if (avx2 < 0) avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    if (avx2 && len - i >= 64) i += ws_xor_avx2(p + i, len - i, k);
+  }
+#endif
+#if MG_ENABLE_SIMD
+  {
+    __m128i km = _mm_set1_epi32((int) k);
+    for (; i + 16 <= len; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+      _mm_storeu_si128((__m128i *) (p + i), _mm_xor_si128(v, km));
+    }
+  }
+#endif
+  for (; i + 8 <= len; i += 8) {
+    uint64_t w;
+    memcpy(&w, p + i, sizeof(w));
+    w ^= k64;
+    memcpy(p + i, &w, sizeof(w));
+  }
+  for (; i < len; i++) p[i] ^= m[i & 3];
+}
+
+// Parse a frame header. Return false if it is incomplete
+static bool ws_header(const uint8_t *buf, size_t len, struct ws_msg *msg) {
+  size_t n = 0, mask_len = 0;
   memset(msg, 0, sizeof(*msg));
   if (len >= 2) {
     n = buf[1] & 0x7f;                // Frame length
@@ -19984,15 +21626,98 @@ static size_t ws_process(uint8_t *buf, size_t len, struct ws_msg *msg) {
   }
   // Sanity check, and integer overflow protection for the boundary check below
   // data_len should not be larger than 1 Gb
-  if (msg->data_len > 1024 * 1024 * 1024) return 0;
+  return msg->header_len > 0 && msg->data_len <= 1024 * 1024 * 1024;
+}
+
+static size_t ws_process(uint8_t *buf, size_t len, struct ws_msg *msg) {
+  if (!ws_header(buf, len, msg)) return 0;
   if (msg->header_len + msg->data_len > len) return 0;
-  if (mask_len > 0) {
-    uint8_t *p = buf + msg->header_len, *m = p - mask_len;
-    for (i = 0; i < msg->data_len; i++) p[i] ^= m[i & 3];
+  if (buf[1] & 128) {
+    uint8_t *p = buf + msg->header_len;
+    ws_xor(p, msg->data_len, p - 4);
   }
   return msg->header_len + msg->data_len;
 }
 
+// Streaming state of a connection, c->wss
+struct ws_stream {
+  size_t offset;     // Message bytes delivered so far
+  size_t left;       // Payload bytes of the current frame not received yet
+  uint8_t flags;     // First frame flags: opcode and RSV1
+  uint8_t mask[4];   // Mask of the current frame, rotated to the next byte
+  bool in_msg;       // A message has started and is not final yet
+  bool in_frame;     // Frame header consumed, payload follows
+  bool final;        // Current frame is the last one of the message
+};
+
+// Streaming mode: hand data frames to the user in parts as they arrive and
+// drop them from c->recv. Return 0 to wait for more data, 1 on progress,
+// 2 if a complete control frame is next, for the regular path
+static int ws_stream(struct mg_connection *c) {
+  struct ws_stream *st = (struct ws_stream *) c->wss;
+  struct mg_ws_message m;
+  size_t n;
+  if (st == NULL) {
+    if ((st = (struct ws_stream *) calloc(1, sizeof(*st))) == NULL) {
+      mg_error(c, "OOM");
+      return 0;
+    }
+    c->wss = st;
+  }
+  if (!st->in_frame) {
+    struct ws_msg msg;
+    uint8_t op;
+    if (!ws_header(c->recv.buf, c->recv.len, &msg)) return 0;
+    op = msg.flags & 15;
+    if (op != WEBSOCKET_OP_CONTINUE && op != WEBSOCKET_OP_TEXT &&
+        op != WEBSOCKET_OP_BINARY) {
+      return msg.header_len + msg.data_len <= c->recv.len ? 2 : 0;
+    }
+    if ((op == WEBSOCKET_OP_CONTINUE) != st->in_msg) {
+      mg_error(c, "WS fragment");
+      return 0;
+    }
+    if (op != WEBSOCKET_OP_CONTINUE) {
+      st->flags = msg.flags & 0x7f, st->offset = 0, st->in_msg = true;
+    }
+    if (c->recv.buf[1] & 128) {
+      memcpy(st->mask, c->recv.buf + msg.header_len - 4, sizeof(st->mask));
+    } else {
+      memset(st->mask, 0, sizeof(st->mask));
+    }
+    st->final = msg.flags & 128;
+    st->left = msg.data_len;
+    st->in_frame = true;
+    mg_iobuf_del(&c->recv, 0, msg.header_len);
+  }
+  n = st->left < c->recv.len ? st->left : c->recv.len;
+  if (n == 0 && st->left > 0) return 0;
+  ws_xor(c->recv.buf, n, st->mask);
+  if (n & 3) {  // Rotate the mask to continue where this part ends
+    uint8_t tmp[4];
+    size_t i;
+    for (i = 0; i < 4; i++) tmp[i] = st->mask[(i + n) & 3];
+    memcpy(st->mask, tmp, sizeof(tmp));
+  }
+  memset(&m, 0, sizeof(m));
+  m.final = st->final && st->left == n;
+  m.data = mg_str_n((char *) c->recv.buf, n);
+  m.flags = (uint8_t) (st->flags | (m.final ? 128 : 0));
+  m.offset = st->offset;
+  st->left -= n;
+  if (n > 0 || m.final) {
+    ws_deliver(c, &m);
+    st->offset += m.data.len;
+  }
+  mg_iobuf_del(&c->recv, 0, n);
+  if (st->left == 0) {
+    st->in_frame = false;
+    if (st->final) st->in_msg = false;
+  }
+  if (!st->in_msg && !c->is_ws_stream) free(st), c->wss = NULL;  // Turned off
+  return 1;
+}
+
 static size_t mkhdr(size_t len, int op, bool is_client, uint8_t *buf) {
   size_t n = 0;
   buf[0] = (uint8_t) (op | 128);
@@ -20023,16 +21748,22 @@ static size_t mkhdr(size_t len, int op, bool is_client, uint8_t *buf) {
 
 static void mg_ws_mask(struct mg_connection *c, size_t len) {
   if (c->is_client && c->send.buf != NULL) {
-    size_t i;
-    uint8_t *p = c->send.buf + c->send.len - len, *mask = p - 4;
-    for (i = 0; i < len; i++) p[i] ^= mask[i & 3];
+    uint8_t *p = c->send.buf + c->send.len - len;
+    ws_xor(p, len, p - 4);
   }
 }
 
 size_t mg_ws_send(struct mg_connection *c, const void *buf, size_t len,
                   int op) {
   uint8_t header[14];
-  size_t header_len = mkhdr(len, op, c->is_client, header);
+  size_t header_len;
+#if MG_ENABLE_WS_DEFLATE
+  if (ws_zippable(c, len, op)) {
+    struct mg_str z = mg_ws_deflate(c, buf, len);
+    if (z.buf != NULL) buf = z.buf, len = z.len, op |= WEBSOCKET_OP_DEFLATED;
+  }
+#endif
+  header_len = mkhdr(len, op, c->is_client, header);
   if (!mg_send(c, header, header_len)) return 0;
   if (!mg_send(c, buf, len)) return header_len;
   MG_VERBOSE(("WS out: %d [%.*s]", (int) len, (int) len, buf));
@@ -20040,6 +21771,28 @@ size_t mg_ws_send(struct mg_connection *c, const void *buf, size_t len,
   return header_len + len;
 }
 
+size_t mg_ws_send_ref(struct mg_connection *c, const void *buf, size_t len,
+                      int op, void (*fn)(void *), void *arg) {
+  uint8_t header[14];
+  size_t header_len;
+  bool copy = c->is_client;  // Masking modifies the payload, send a copy
+#if MG_ENABLE_WS_DEFLATE
+  if (ws_zippable(c, len, op)) copy = true;  // Sent compressed instead
+#endif
+  if (copy) {
+    len = mg_ws_send(c, buf, len, op);
+    if (fn != NULL) fn(arg);
+    return len;
+  }
+  header_len = mkhdr(len, op, false, header);
+  if (!mg_send(c, header, header_len)) {
+    if (fn != NULL) fn(arg);
+    return 0;
+  }
+  if (!mg_send_ref(c, buf, len, fn, arg)) return header_len;
+  return header_len + len;
+}
+
 static bool mg_ws_client_handshake(struct mg_connection *c) {
   int n = mg_http_get_request_len(c->recv.buf, c->recv.len);
   if (n < 0) {
@@ -20050,8 +21803,16 @@ static bool mg_ws_client_handshake(struct mg_connection *c) {
     } else {
       struct mg_http_message hm;
       if (mg_http_parse((char *) c->recv.buf, c->recv.len, &hm)) {
-        c->is_websocket = 1;
-        mg_call(c, MG_EV_WS_OPEN, &hm);
+#if MG_ENABLE_WS_DEFLATE
+        struct mg_str *ext = mg_http_get_header(&hm, "Sec-WebSocket-Extensions");
+        if (!ws_deflate_agreed(c, ext)) {
+          mg_error(c, "WS extensions");
+        } else
+#endif
+        {
+          c->is_websocket = 1;
+          mg_call(c, MG_EV_WS_OPEN, &hm);
+        }
       } else {
         mg_error(c, "ws handshake error");
       }
@@ -20071,11 +21832,22 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
   if (ev == MG_EV_READ) {
     if (c->is_client && !c->is_websocket && mg_ws_client_handshake(c)) return;
 
-    while (ws_process(c->recv.buf + ofs, c->recv.len - ofs, &msg) > 0) {
-      char *s = (char *) c->recv.buf + ofs + msg.header_len;
-      struct mg_ws_message m = {{s, msg.data_len}, msg.flags};
-      size_t len = msg.header_len + msg.data_len;
-      uint8_t final = msg.flags & 128, op = msg.flags & 15;
+    for (;;) {
+      char *s;
+      struct mg_ws_message m;
+      size_t len;
+      uint8_t final, op;
+      if (ofs == 0 && (c->is_ws_stream || c->wss != NULL)) {
+        int rc = ws_stream(c);
+        if (rc == 0 || c->is_closing) break;
+        if (rc == 1) continue;
+      }
+      if (ws_process(c->recv.buf + ofs, c->recv.len - ofs, &msg) == 0) break;
+      s = (char *) c->recv.buf + ofs + msg.header_len;
+      memset(&m, 0, sizeof(m));
+      m.data = mg_str_n(s, msg.data_len), m.flags = msg.flags, m.final = true;
+      len = msg.header_len + msg.data_len;
+      final = msg.flags & 128, op = msg.flags & 15;
       // MG_VERBOSE ("fin %d op %d len %d [%.*s]", final, op,
       //                       (int) m.data.len, (int) m.data.len, m.data.buf));
       switch (op) {
@@ -20092,7 +21864,7 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
           break;
         case WEBSOCKET_OP_TEXT:
         case WEBSOCKET_OP_BINARY:
-          if (final) mg_call(c, MG_EV_WS_MSG, &m);
+          if (final) ws_deliver(c, &m);
           break;
         case WEBSOCKET_OP_CLOSE:
           MG_DEBUG(("%lu WS CLOSE", c->id));
@@ -20122,13 +21894,20 @@ static void mg_ws_cb(struct mg_connection *c, int ev, void *ev_data) {
       if (final && !op && (ofs > 0)) {
         m.flags = c->recv.buf[0];
         m.data = mg_str_n((char *) &c->recv.buf[1], (size_t) (ofs - 1));
-        mg_call(c, MG_EV_WS_MSG, &m);
+        ws_deliver(c, &m);
         mg_iobuf_del(&c->recv, 0, ofs);
         ofs = 0;
         c->pfn_data = NULL;
       }
     }
   }
+  if (ev == MG_EV_CLOSE) {
+#if MG_ENABLE_WS_DEFLATE
+    ws_deflate_free(c);
+#endif
+    free(c->wss);
+    c->wss = NULL;
+  }
   (void) ev_data;
 }
 
@@ -20149,6 +21928,13 @@ struct mg_connection *mg_ws_connect(struct mg_mgr *mgr, const char *url,
                "Sec-WebSocket-Version: 13\r\n"
                "Sec-WebSocket-Key: %s\r\n",
                mg_url_uri(url), (int) host.len, host.buf, key);
+#if MG_ENABLE_WS_DEFLATE
+    if (mgr->ws_deflate.enabled) {
+      mg_xprintf(mg_pfn_iobuf, &c->send,
+                 "Sec-WebSocket-Extensions: permessage-deflate; "
+                 "client_max_window_bits\r\n");
+    }
+#endif
     if (fmt != NULL) {
       va_list ap;
       va_start(ap, fmt);
@@ -20172,9 +21958,14 @@ void mg_ws_upgrade(struct mg_connection *c, struct mg_http_message *hm,
     c->is_draining = 1;
   } else {
     struct mg_str *wsproto = mg_http_get_header(hm, "Sec-WebSocket-Protocol");
+    char ext[160] = "";
     va_list ap;
+#if MG_ENABLE_WS_DEFLATE
+    ws_deflate_accept(c, mg_http_get_header(hm, "Sec-WebSocket-Extensions"),
+                      ext, sizeof(ext));
+#endif
     va_start(ap, fmt);
-    ws_handshake(c, wskey, wsproto, fmt, &ap);
+    ws_handshake(c, wskey, wsproto, ext, fmt, &ap);
     va_end(ap);
     c->is_websocket = 1;
     c->is_resp = 0;
@@ -20184,8 +21975,19 @@ void mg_ws_upgrade(struct mg_connection *c, struct mg_http_message *hm,
 
 size_t mg_ws_wrap(struct mg_connection *c, size_t len, int op) {
   uint8_t header[14], *p;
-  size_t header_len = mkhdr(len, op, c->is_client, header);
+  size_t header_len;
 
+#if MG_ENABLE_WS_DEFLATE
+  if (ws_zippable(c, len, op) && len <= c->send.len) {
+    struct mg_str z = mg_ws_deflate(c, c->send.buf + c->send.len - len, len);
+    if (z.buf != NULL) {
+      c->send.len -= len;
+      mg_ws_send(c, z.buf, z.len, op | WEBSOCKET_OP_DEFLATED);
+      return c->send.len;
+    }
+  }
+#endif
+  header_len = mkhdr(len, op, c->is_client, header);
   // NOTE: order of operations is important!
   if (mg_iobuf_add(&c->send, c->send.len, NULL, header_len) != 0) {
     p = &c->send.buf[c->send.len - len];         // p points to data
@@ -369,6 +369,14 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 #define MG_ENABLE_POLL 1
 #endif
 
+#if !defined(MG_ENABLE_ACCEPT4) && defined(__linux__)
+#define MG_ENABLE_ACCEPT4 1  // Use accept4(SOCK_NONBLOCK | SOCK_CLOEXEC)
+#endif
+
+#ifndef MG_ENABLE_SENDMSG
+#define MG_ENABLE_SENDMSG 1  // Send mg_send_ref() data with sendmsg()
+#endif
+
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
@@ -390,6 +398,11 @@ static inline int mg_mkdir(const char *path, mode_t mode) {
 
 #if defined(MG_ENABLE_EPOLL) && MG_ENABLE_EPOLL
 #include <sys/epoll.h>
+#if defined(MG_ENABLE_IO_URING) && MG_ENABLE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 #elif defined(MG_ENABLE_POLL) && MG_ENABLE_POLL
 #include <poll.h>
 #else
@@ -789,6 +802,114 @@ struct timeval {
 #define MG_ENABLE_EPOLL 0
 #endif
 
+#ifndef MG_ENABLE_ACCEPT4
+#define MG_ENABLE_ACCEPT4 0
+#endif
+
+// Edge-triggered epoll: on readiness, read until the socket would block or
+// MG_EPOLL_ET_BUDGET reads are done, write until the send buffer is empty or
+// the socket would block. Implies MG_ENABLE_EPOLL_READY
+#ifndef MG_ENABLE_EPOLL_ET
+#define MG_ENABLE_EPOLL_ET 0
+#endif
+
+// Process only active connections on each poll: those with IO readiness,
+// pending output or TLS data, or in a transitional state. Idle connections
+// do not receive MG_EV_POLL. Requires MG_ENABLE_EPOLL
+#ifndef MG_ENABLE_EPOLL_READY
+#define MG_ENABLE_EPOLL_READY MG_ENABLE_EPOLL_ET
+#endif
+
+#if MG_ENABLE_EPOLL_READY && !MG_ENABLE_EPOLL
+#undef MG_ENABLE_EPOLL_READY
+#define MG_ENABLE_EPOLL_READY 0
+#endif
+
+#if MG_ENABLE_EPOLL_ET && !MG_ENABLE_EPOLL_READY
+#undef MG_ENABLE_EPOLL_ET
+#define MG_ENABLE_EPOLL_ET 0
+#endif
+
+#ifndef MG_EPOLL_ET_BUDGET
+#define MG_EPOLL_ET_BUDGET 16  // Reads/writes per connection per poll
+#endif
+
+// io_uring backend: multishot accept and recv into a provided buffer ring,
+// plain TCP sends batched into the io_uring_enter() that waits for events.
+// Used by default when enabled, falls back to epoll if the kernel refuses
+// it (needs 5.19+). See mg_io_uring_init(). Requires MG_ENABLE_EPOLL
+#ifndef MG_ENABLE_IO_URING
+#define MG_ENABLE_IO_URING 0
+#endif
+
+#if MG_ENABLE_IO_URING && (!MG_ENABLE_EPOLL || !MG_ENABLE_SOCKET)
+#undef MG_ENABLE_IO_URING
+#define MG_ENABLE_IO_URING 0
+#endif
+
+#ifndef MG_IO_URING_ENTRIES
+#define MG_IO_URING_ENTRIES 256  // Submission queue size
+#endif
+
+#ifndef MG_IO_URING_BUFS
+#define MG_IO_URING_BUFS 256  // Receive buffers, power of 2
+#endif
+
+#ifndef MG_IO_URING_BUF_SIZE
+#define MG_IO_URING_BUF_SIZE MG_IO_SIZE  // Size of each receive buffer
+#endif
+
+// Vectored sends: data queued by mg_send_ref() goes out together with
+// c->send in one sendmsg(). Without it, and for TLS, the queued pieces are
+// written one at a time. Either way the data is sent from the caller's
+// memory, which must stay valid until fn is called. Only UDP, builds
+// without MG_ENABLE_SOCKET and data shorter than MG_SEND_REF_MIN are copied
+#ifndef MG_ENABLE_SENDMSG
+#define MG_ENABLE_SENDMSG 0
+#endif
+
+#if MG_ENABLE_SENDMSG && !MG_ENABLE_SOCKET
+#undef MG_ENABLE_SENDMSG
+#define MG_ENABLE_SENDMSG 0
+#endif
+
+#ifndef MG_SEND_REF_MIN
+#define MG_SEND_REF_MIN 512  // mg_send_ref() copies data shorter than this
+#endif
+
+#ifndef MG_IOV_MAX
+#define MG_IOV_MAX 64  // Segments per sendmsg()
+#endif
+
+#ifndef MG_HTTP_INLINE_FILE
+#define MG_HTTP_INLINE_FILE MG_IO_SIZE  // Serve files up to this size at once
+#endif
+
+// SSE2 code paths on x86, plus AVX2 ones chosen at runtime with GCC/Clang
+#ifndef MG_ENABLE_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MG_ENABLE_SIMD 1
+#else
+#define MG_ENABLE_SIMD 0
+#endif
+#endif
+
+#ifndef MG_ENABLE_WS_DEFLATE
+#define MG_ENABLE_WS_DEFLATE 0  // WebSocket permessage-deflate, needs zlib
+#endif
+
+#if MG_ENABLE_SIMD
+#include <immintrin.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MG_SIMD_AVX2 1
+#endif
+#endif
+
+#ifndef MG_EPOLL_MAX_EVENTS
+#define MG_EPOLL_MAX_EVENTS 256  // epoll_wait() batch, MG_ENABLE_EPOLL_READY
+#endif
+
 #ifndef MG_ENABLE_FATFS
 #define MG_ENABLE_FATFS 0
 #endif
@@ -843,6 +964,38 @@ struct timeval {
 #define MG_MAX_RECV_SIZE (3UL * 1024UL * 1024UL)  // Maximum recv IO buffer size
 #endif
 
+// IO buffers grow by at least this percentage of their size, so that
+// filling a buffer costs amortised O(1) copies per byte. 0 grows them only
+// as much as needed, in MG_IO_SIZE steps. See struct mg_iobuf :: growth
+#ifndef MG_IOBUF_GROWTH
+#define MG_IOBUF_GROWTH 100
+#endif
+
+// Resize IO buffers with realloc(), which often grows them in place, instead
+// of calloc() + copy + free(). Only the added space is zeroed
+#ifndef MG_IOBUF_REALLOC
+#define MG_IOBUF_REALLOC \
+  (MG_ARCH == MG_ARCH_UNIX || MG_ARCH == MG_ARCH_WIN32)
+#endif
+
+// Keep closed connections and their IO buffers in per-manager free lists
+// and reuse them, instead of returning them to the system allocator
+#ifndef MG_ENABLE_POOL
+#define MG_ENABLE_POOL (MG_ARCH == MG_ARCH_UNIX || MG_ARCH == MG_ARCH_WIN32)
+#endif
+
+#ifndef MG_POOL_CONNS
+#define MG_POOL_CONNS 256  // Max free connection objects kept
+#endif
+
+#ifndef MG_POOL_CLASSES
+#define MG_POOL_CLASSES 4  // IO buffer sizes kept: MG_IO_SIZE << 0 .. 3
+#endif
+
+#ifndef MG_POOL_CLASS_BYTES
+#define MG_POOL_CLASS_BYTES (MG_POOL_CONNS * MG_IO_SIZE)  // Max bytes per size
+#endif
+
 #ifndef MG_DATA_SIZE
 #define MG_DATA_SIZE 32  // struct mg_connection :: data size
 #endif
@@ -867,6 +1020,10 @@ struct timeval {
 #define MG_SOCK_LISTEN_BACKLOG_SIZE 128
 #endif
 
+#ifndef MG_SOCK_ACCEPT_BATCH
+#define MG_SOCK_ACCEPT_BATCH 64  // Max connections accepted per poll
+#endif
+
 #ifndef MG_DIRSEP
 #define MG_DIRSEP '/'
 #endif
@@ -888,15 +1045,24 @@ struct timeval {
 #endif
 
 #if MG_ENABLE_EPOLL
+#if MG_ENABLE_EPOLL_ET
+#define MG_EPOLL_EVENTS (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLET)
+#else
+#define MG_EPOLL_EVENTS (EPOLLIN | EPOLLERR | EPOLLHUP)
+#endif
 #define MG_EPOLL_ADD(c)                                                    \
   do {                                                                     \
-    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
+    struct epoll_event ev = {MG_EPOLL_EVENTS, {c}};                        \
+    if (c->mgr->epoll_fd < 0) break; /* io_uring is used instead */        \
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, (int) (size_t) c->fd, &ev); \
   } while (0)
 #define MG_EPOLL_MOD(c, wr)                                                \
   do {                                                                     \
-    struct epoll_event ev = {EPOLLIN | EPOLLERR | EPOLLHUP, {c}};          \
+    struct epoll_event ev = {MG_EPOLL_EVENTS, {c}};                        \
+    if ((wr) == (bool) c->is_pollout) break;  /* No change */              \
+    if (c->mgr->epoll_fd < 0) break;                                       \
     if (wr) ev.events |= EPOLLOUT;                                         \
+    c->is_pollout = (wr) ? 1U : 0U;                                        \
     epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_MOD, (int) (size_t) c->fd, &ev); \
   } while (0)
 #else
@@ -1067,6 +1233,8 @@ struct mg_timer {
   void (*fn)(void *);          // Function to call
   void *arg;                   // Function argument
   struct mg_timer *next;       // Linkage
+  struct mg_timer **pprev;     // Timer wheel only. Back link, for O(1) delete
+  unsigned slot;               // Timer wheel only. Slot index, see below
 };
 
 void mg_timer_init(struct mg_timer **head, struct mg_timer *timer,
@@ -1076,6 +1244,36 @@ void mg_timer_free(struct mg_timer **head, struct mg_timer *);
 void mg_timer_poll(struct mg_timer **head, uint64_t new_ms);
 bool mg_timer_expired(uint64_t *expiration, uint64_t period, uint64_t now);
 
+// Hierarchical timing wheel. Each level has MG_TIMER_WHEEL_SLOTS slots, and
+// every level is MG_TIMER_WHEEL_SLOTS times coarser than the previous one.
+// Level 0 has 1ms granularity. Insert and delete are O(1), and poll does
+// work proportional to the number of expired timers
+#define MG_TIMER_WHEEL_BITS 6
+#define MG_TIMER_WHEEL_SLOTS (1U << MG_TIMER_WHEEL_BITS)
+#define MG_TIMER_WHEEL_LEVELS 6
+#define MG_TIMER_SLOT_DUE (MG_TIMER_WHEEL_LEVELS * MG_TIMER_WHEEL_SLOTS)
+#define MG_TIMER_SLOT_FAR (MG_TIMER_SLOT_DUE + 1)   // Beyond the last level
+#define MG_TIMER_SLOT_NONE (MG_TIMER_SLOT_DUE + 2)  // Not in the wheel
+
+struct mg_timer_wheel {
+  uint64_t now;                                     // Current wheel time
+  uint64_t occupied[MG_TIMER_WHEEL_LEVELS];         // Non-empty slots bitmap
+  struct mg_timer *slots[MG_TIMER_WHEEL_LEVELS][MG_TIMER_WHEEL_SLOTS];
+  struct mg_timer *due;                             // Expire on next poll
+  struct mg_timer *far;                             // Too far in the future
+  struct mg_timer *running;                         // Timer being called now
+  bool running_deleted;                             // Deleted while running
+  size_t count;                                     // Number of timers
+};
+
+void mg_timer_wheel_init(struct mg_timer_wheel *, uint64_t now);
+void mg_timer_wheel_add(struct mg_timer_wheel *, struct mg_timer *);
+void mg_timer_wheel_del(struct mg_timer_wheel *, struct mg_timer *);
+void mg_timer_wheel_unlink(struct mg_timer_wheel *, struct mg_timer *);
+void mg_timer_wheel_poll(struct mg_timer_wheel *, uint64_t now);
+void mg_timer_wheel_free(struct mg_timer_wheel *);
+uint64_t mg_timer_wheel_next(struct mg_timer_wheel *);
+
 
 
 
@@ -1261,6 +1459,9 @@ struct mg_iobuf {
   size_t size;         // Total size available
   size_t len;          // Current number of bytes
   size_t align;        // Alignment during allocation
+  int growth;          // Growth, % of size. 0: MG_IOBUF_GROWTH, <0: as needed
+  size_t head;         // Consumed bytes before buf, reclaimed lazily
+  bool scrub;          // Zero bytes when consumed or freed
 };
 
 int mg_iobuf_init(struct mg_iobuf *, size_t, size_t);
@@ -1268,6 +1469,7 @@ int mg_iobuf_resize(struct mg_iobuf *, size_t);
 void mg_iobuf_free(struct mg_iobuf *);
 size_t mg_iobuf_add(struct mg_iobuf *, size_t, const void *, size_t);
 size_t mg_iobuf_del(struct mg_iobuf *, size_t ofs, size_t len);
+int mg_iobuf_grow(struct mg_iobuf *, size_t need, size_t limit);
 
 
 size_t mg_base64_update(unsigned char input_byte, char *buf, size_t len);
@@ -2215,6 +2417,7 @@ enum {
   MG_EV_MQTT_OPEN,  // MQTT CONNACK received        int *connack_status_code
   MG_EV_SNTP_TIME,  // SNTP time received           uint64_t *epoch_millis
   MG_EV_WAKEUP,     // mg_wakeup() data received    struct mg_str *data
+  MG_EV_HTTP_CHUNK, // Streamed HTTP body part      struct mg_http_message *
   MG_EV_USER        // Starting ID for user events
 };
 
@@ -2239,6 +2442,26 @@ struct mg_addr {
   bool is_ip6;       // True when address is IPv6 address
 };
 
+// Free lists of struct mg_mgr :: pool, see MG_ENABLE_POOL
+struct mg_pool {
+  struct mg_connection *conns;    // Free connection objects
+  void *bufs[MG_POOL_CLASSES];    // Free IO buffers, MG_IO_SIZE << class
+  unsigned nconns;                // Number of free connection objects
+  unsigned nbufs[MG_POOL_CLASSES];  // Number of free IO buffers
+  unsigned long conn_hits, conn_misses;  // Connection allocations served
+  unsigned long buf_hits, buf_misses;    // IO buffer allocations served
+};
+
+// WebSocket permessage-deflate (RFC 7692) settings, see MG_ENABLE_WS_DEFLATE
+struct mg_ws_deflate {
+  bool enabled;              // Negotiate permessage-deflate
+  bool no_context_takeover;  // Compress each message on its own, both ways
+  int window_bits;           // Compression window, 9..15. 0: 15
+  int mem_level;             // zlib memLevel, 1..9. 0: 8
+  int level;                 // zlib compression level, 1..9. 0: zlib default
+  size_t threshold;          // Send shorter messages uncompressed
+};
+
 struct mg_mgr {
   struct mg_connection *conns;  // List of active connections
   struct mg_dns dns4;           // DNS for IPv4
@@ -2250,11 +2473,22 @@ struct mg_mgr {
   void *tls_ctx;                // TLS context shared by all TLS sessions
   uint16_t mqtt_id;             // MQTT IDs for pub/sub
   void *active_dns_requests;    // DNS requests in progress
-  struct mg_timer *timers;      // Active timers
+  struct mg_timer_wheel timers;  // Active timers
   int epoll_fd;                 // Used when MG_EPOLL_ENABLE=1
   struct mg_tcpip_if *ifp;      // Builtin TCP/IP stack only. Interface pointer
   size_t extraconnsize;         // Builtin TCP/IP stack only. Extra space
   MG_SOCKET_TYPE pipe;          // Socketpair end for mg_wakeup()
+  int listen_backlog;           // listen() backlog for new listeners
+  int accept_batch;             // Max connections accepted per poll
+  bool (*accept_fn)(struct mg_mgr *, const struct mg_addr *);  // Admit?
+  int iobuf_growth;             // Connection IO buffer growth, see mg_iobuf
+  bool scrub;                   // Scrub recv/send buffers of new connections
+  struct mg_pool pool;          // Reusable connections and IO buffers
+  struct mg_ws_deflate ws_deflate;  // WebSocket compression settings
+  struct mg_connection *active;  // MG_ENABLE_EPOLL_READY: next poll's queue
+#if MG_ENABLE_IO_URING
+  struct mg_uring *uring;  // io_uring backend state, NULL when epoll is used
+#endif
 #if MG_ENABLE_FREERTOS_TCP
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
@@ -2262,6 +2496,7 @@ struct mg_mgr {
 
 struct mg_connection {
   struct mg_connection *next;     // Linkage in struct mg_mgr :: connections
+  struct mg_connection *anext;    // Linkage in struct mg_mgr :: active
   struct mg_mgr *mgr;             // Our container
   struct mg_addr loc;             // Local address
   struct mg_addr rem;             // Remote address
@@ -2269,12 +2504,18 @@ struct mg_connection {
   unsigned long id;               // Auto-incrementing unique connection ID
   struct mg_iobuf recv;           // Incoming data
   struct mg_iobuf send;           // Outgoing data
+  struct mg_iobuf refs;           // Outgoing data by reference, mg_send_ref()
   struct mg_iobuf prof;           // Profile data enabled by MG_ENABLE_PROFILE
   struct mg_iobuf rtls;           // TLS only. Incoming encrypted data
   mg_event_handler_t fn;          // User-specified event handler function
   void *fn_data;                  // User-specified function parameter
   mg_event_handler_t pfn;         // Protocol-specific handler function
   void *pfn_data;                 // Protocol-specific function parameter
+#if MG_ENABLE_WS_DEFLATE
+  void *wsd;                      // WebSocket permessage-deflate state
+#endif
+  void *wss;                      // WebSocket streaming state, is_ws_stream
+  size_t rx_body;                 // HTTP body delivered so far, is_http_stream
   char data[MG_DATA_SIZE];        // Arbitrary connection data
   void *tls;                      // TLS specific data
   unsigned is_listening : 1;      // Listening connection
@@ -2296,6 +2537,24 @@ struct mg_connection {
   unsigned is_resp : 1;           // Response is still being generated
   unsigned is_readable : 1;       // Connection is ready to read
   unsigned is_writable : 1;       // Connection is ready to write
+  unsigned is_active : 1;         // Queued for processing, see mgr->active
+  unsigned is_pollout : 1;        // EPOLLOUT is registered for this socket
+  unsigned is_rdmore : 1;         // Edge-triggered IO: socket not drained
+  unsigned is_wrmore : 1;         // MG_ENABLE_EPOLL_ET: write budget spent
+  unsigned is_ws_stream : 1;      // Deliver WS messages in parts as they arrive
+  unsigned is_http_stream : 1;    // Deliver HTTP body in MG_EV_HTTP_CHUNK parts
+  unsigned is_http_hdrs : 1;      // MG_EV_HTTP_HDRS sent for current request
+#if MG_ENABLE_IO_URING
+  unsigned is_urecv : 1;   // io_uring: multishot recv or accept is armed
+  unsigned is_upoll : 1;   // io_uring: multishot POLLIN is armed
+  unsigned is_uwait : 1;   // io_uring: POLLOUT is armed
+  unsigned is_usend : 1;   // io_uring: send submitted, no completion yet
+  unsigned is_usdone : 1;  // io_uring: send completed, see usent
+  unsigned is_ueof : 1;    // io_uring: recv reported EOF or error
+  unsigned is_unobuf : 1;  // io_uring: recv ran out of buffers
+  struct mg_iobuf rxq;     // io_uring: received buffers not read yet
+  long usent;              // io_uring: result of the last batched send
+#endif
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
@@ -2314,9 +2573,39 @@ size_t mg_printf(struct mg_connection *, const char *fmt, ...);
 size_t mg_vprintf(struct mg_connection *, const char *fmt, va_list *ap);
 bool mg_aton(struct mg_str str, struct mg_addr *addr);
 
+// Data queued by mg_send_ref(), kept in c->refs
+struct mg_sendref {
+  size_t ofs;             // Goes out after this many bytes of c->send
+  const char *buf;        // Data not sent yet
+  size_t len;             // Its length
+  void (*fn)(void *arg);  // Called when the data is no longer needed
+  void *arg;              // Argument for fn
+};
+
+// Like mg_send(), but queue a reference to buf instead of a copy. buf must
+// stay valid until fn(arg) is called, which happens once it is sent or the
+// connection is closed, or right away if the data was copied
+bool mg_send_ref(struct mg_connection *, const void *buf, size_t len,
+                 void (*fn)(void *), void *arg);
+size_t mg_send_queued(const struct mg_connection *);  // Output not sent yet
+
+// Queue connection for the next poll. With MG_ENABLE_EPOLL_READY, call it
+// after changing e.g. is_closing outside of the connection's event handler
+void mg_conn_activate(struct mg_connection *c);
+
+#if MG_ENABLE_IO_URING
+// Switch manager to io_uring, or back to epoll. Call only while the manager
+// has no connections. mg_mgr_init() calls mg_io_uring_init() itself.
+// Return false if io_uring is unavailable, the manager then keeps epoll
+bool mg_io_uring_init(struct mg_mgr *);
+void mg_io_uring_free(struct mg_mgr *);
+#endif
+
 // These functions are used to integrate with custom network stacks
 struct mg_connection *mg_alloc_conn(struct mg_mgr *);
 void mg_close_conn(struct mg_connection *c);
+void mg_send_del(struct mg_connection *c, size_t len);  // Drop sent output
+void mg_pool_iobuf(struct mg_mgr *, struct mg_iobuf *, size_t need);
 bool mg_open_listener(struct mg_connection *c, const char *url);
 
 // Utility functions
@@ -2324,6 +2613,10 @@ bool mg_wakeup(struct mg_mgr *, unsigned long id, const void *buf, size_t len);
 bool mg_wakeup_init(struct mg_mgr *);
 struct mg_timer *mg_timer_add(struct mg_mgr *mgr, uint64_t milliseconds,
                               unsigned flags, void (*fn)(void *), void *arg);
+void mg_timer_start(struct mg_mgr *mgr, struct mg_timer *t,
+                    uint64_t milliseconds, unsigned flags,
+                    void (*fn)(void *), void *arg);
+void mg_timer_del(struct mg_mgr *mgr, struct mg_timer *t);
 
 
 
@@ -2337,12 +2630,17 @@ struct mg_http_header {
   struct mg_str value;  // Header value
 };
 
+#define MG_HTTP_KNOWN 18  // Well-known headers indexed by mg_http_parse()
+
 struct mg_http_message {
   struct mg_str method, uri, query, proto;             // Request/response line
   struct mg_http_header headers[MG_MAX_HTTP_HEADERS];  // Headers
   struct mg_str body;                                  // Body
   struct mg_str head;                                  // Request + headers
   struct mg_str message;  // Request + headers + body
+  struct mg_str chunk;    // Body part for MG_EV_HTTP_CHUNK, see is_http_stream
+  unsigned short known[MG_HTTP_KNOWN];  // Well-known header index + 1, or 0
+  bool indexed;                         // known[] is set by mg_http_parse()
 };
 
 // Parameter for mg_http_serve_dir()
@@ -2377,6 +2675,10 @@ void mg_http_serve_file(struct mg_connection *, struct mg_http_message *hm,
                         const char *path, const struct mg_http_serve_opts *);
 void mg_http_reply(struct mg_connection *, int status_code, const char *headers,
                    const char *body_fmt, ...);
+void mg_http_reply_ref(struct mg_connection *, int status_code,
+                       const char *headers, const void *body, size_t len,
+                       void (*fn)(void *), void *arg);  // See mg_send_ref()
+const char *mg_http_status_code_str(int status_code);  // Reason phrase
 struct mg_str *mg_http_get_header(struct mg_http_message *, const char *name);
 struct mg_str mg_http_var(struct mg_str buf, struct mg_str name);
 int mg_http_get_var(const struct mg_str *, const char *name, char *, size_t);
@@ -2489,12 +2791,15 @@ struct mg_tls {
 #define WEBSOCKET_OP_CLOSE 8
 #define WEBSOCKET_OP_PING 9
 #define WEBSOCKET_OP_PONG 10
+#define WEBSOCKET_OP_DEFLATED 0x40  // OR to op: data is deflated already
 
 
 
 struct mg_ws_message {
   struct mg_str data;  // Websocket message data
   uint8_t flags;       // Websocket message flags
+  size_t offset;       // Position of data in the message, see is_ws_stream
+  bool final;          // This is the last part of the message
 };
 
 struct mg_connection *mg_ws_connect(struct mg_mgr *, const char *url,
@@ -2503,7 +2808,12 @@ struct mg_connection *mg_ws_connect(struct mg_mgr *, const char *url,
 void mg_ws_upgrade(struct mg_connection *, struct mg_http_message *,
                    const char *fmt, ...);
 size_t mg_ws_send(struct mg_connection *, const void *buf, size_t len, int op);
+size_t mg_ws_send_ref(struct mg_connection *, const void *buf, size_t len,
+                      int op, void (*fn)(void *), void *arg);
 size_t mg_ws_wrap(struct mg_connection *, size_t len, int op);
+int mg_ws_deflate_key(struct mg_connection *, size_t len);
+struct mg_str mg_ws_deflate(struct mg_connection *, const void *buf,
+                            size_t len);
 size_t mg_ws_printf(struct mg_connection *c, int op, const char *fmt, ...);
 size_t mg_ws_vprintf(struct mg_connection *c, int op, const char *fmt,
                      va_list *);